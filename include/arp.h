@@ -9,6 +9,34 @@
 #define ARP_REQUEST  0x0001
 #define ARP_REPLY    0x0002
 
+/* Tabla de vecinos */
+#define ARP_TABLE_SIZE          65536   /* Entradas, potencia de 2 */
+#define ARP_PROBE_WINDOW        16      /* Huecos donde puede vivir una IP a partir de su hash */
+#define ARP_REACHABLE_MS        30000   /* Confirmado hace menos: alcanzable */
+#define ARP_STALE_MS            300000  /* Hasta aqui obsoleto (se usa y se refresca), despues caducado */
+#define ARP_PROBE_INTERVAL_MS   1000    /* Como mucho una peticion de refresco por vecino y segundo */
+#define ARP_USED_GRANULARITY_MS 1000    /* Resolucion del LRU, evita escribir en cada busqueda */
+
+/* Paquetes retenidos mientras se resuelve su vecino */
+#define ARP_PENDING_NEIGHBORS   64      /* Resoluciones en curso a la vez */
+#define ARP_PENDING_PACKETS     8       /* Por vecino, al llenarse se descarta el mas antiguo */
+#define ARP_RETRANSMIT_MS       250     /* Entre peticiones a un vecino que no contesta */
+#define ARP_MAX_REQUESTS        4       /* Sin respuesta tras estas, se descarta lo retenido */
+
+/* Cubos de fichas frente a tormentas ARP: paquetes por segundo y rafaga */
+#define ARP_RX_RATE             2000    /* Todo el ARP recibido */
+#define ARP_RX_BURST            500
+#define ARP_SOURCE_RATE         50      /* Por MAC origen */
+#define ARP_SOURCE_BURST        20
+#define ARP_SOURCE_BUCKETS      1024    /* MACs que comparten cubo si colisionan, potencia de 2 */
+#define ARP_TX_RATE             200     /* Peticiones que salen (fallos, refrescos, reintentos) */
+#define ARP_TX_BURST            50
+
+/* Resultado de arp_lookup */
+#define ARP_LOOKUP_MISS        -1
+#define ARP_LOOKUP_REACHABLE    0
+#define ARP_LOOKUP_STALE        1      /* MAC valida, el llamador debe pedir confirmacion */
+
 typedef struct arp_packet {
     uint16_t hw_type;       
     uint16_t proto_type;    
@@ -21,19 +49,55 @@ typedef struct arp_packet {
     uint8_t  target_ip[4];
 } __attribute__((packed)) arp_packet;
 
-void arp_handle(const void *data, unsigned int length,
-                const uint8_t *src_mac, device_handle *dev,
-                nic_driver_t *drv);
+void arp_handle(nic_packet_t *pkt, const uint8_t *src_mac,
+                device_handle *dev, nic_driver_t *drv);
 
 unsigned int arp_build_request(void *buffer, device_handle *dev,
+                               const uint8_t *sender_ip,
                                const uint8_t *target_ip);
 
 unsigned int arp_build_reply(void *buffer, device_handle *dev,
+                             const uint8_t *sender_ip,
                              const uint8_t *target_mac,
                              const uint8_t *target_ip);
 
+typedef struct arp_table_stats {
+    unsigned int capacity;
+    unsigned int reachable;
+    unsigned int stale;
+    unsigned long evictions;    /* Vecinos vivos desalojados por falta de sitio */
+} arp_table_stats_t;
+
+/* Sin cerrojos, se puede llamar desde cualquier worker a la vez */
 int arp_lookup(const uint8_t *ip, uint8_t *out_mac);
 
 void arp_cache_update(const uint8_t *ip, const uint8_t *mac);
 
+/* Confirma un vecino que ya esta en la tabla con esa MAC (trafico IPv4 suyo).
+   No crea entradas ni toma cerrojos, como mucho un store por segundo */
+void arp_refresh(const uint8_t *ip, const uint8_t *mac);
+
+void arp_get_table_stats(arp_table_stats_t *stats);
+
+/* dst_mac NULL: broadcast. La peticion sale por la VLAN de orig */
+int arp_send_request(device_handle *dev, nic_driver_t *drv, const nic_packet_t *orig,
+                     const uint8_t *sender_ip, const uint8_t *target_ip,
+                     const uint8_t *dst_mac);
+
+/* Retiene pkt (con su cabecera IPv4 ya puesta) hasta que ip responda y lo
+   envia entonces. Se queda con el paquete; 0 si queda retenido o enviado */
+int arp_hold_packet(device_handle *dev, nic_driver_t *drv, const uint8_t *ip,
+                    const uint8_t *sender_ip, nic_packet_t *pkt);
+
+/* Anuncia ip (sender = target) a todo el segmento para que los vecinos
+   actualicen su cache tras un cambio de direccion */
+int arp_send_gratuitous(device_handle *dev, nic_driver_t *drv, const uint8_t *ip);
+
+/* Reenvia peticiones y descarta lo que no se resolvio. Devuelve los ms hasta
+   la proxima vez que tiene algo que hacer, -1 si no hay nada pendiente.
+   Es el temporizador del worker de TX (NIC_IOCTL_SET_TIMER_CALLBACK); Ethernet
+   ademas lo llama con cada rafaga recibida. Sin resoluciones pendientes no
+   cuesta mas que una lectura */
+int arp_pending_tick(void);
+
 #endif
\ No newline at end of file
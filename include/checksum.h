@@ -0,0 +1,74 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* Checksum de Internet (RFC 1071) compartido por IPv4, ICMP y TCP.
+   Las sumas parciales son de 64 bits sin plegar y se encadenan: todos los
+   trozos salvo el ultimo deben tener longitud par. */
+
+/* Suma data a sum. Usa AVX2 o SSE2 si la CPU los tiene (se elige en la primera llamada) */
+uint64_t csum_partial(const void *data, size_t len, uint64_t sum);
+
+/* Nombre del nucleo elegido: "avx2", "sse2" o "scalar" */
+const char * csum_kernel_name(void);
+
+/* Pliega una suma parcial a 16 bits y la complementa: el valor del campo checksum */
+static inline uint16_t csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+static inline uint16_t csum(const void *data, size_t len)
+{
+    return csum_fold(csum_partial(data, len, 0));
+}
+
+/* Un bloque con su propio checksum dentro es correcto si suma 0 */
+static inline int csum_verify(const void *data, size_t len)
+{
+    return csum(data, len) == 0;
+}
+
+/* Cabecera IPv4 de ihl palabras de 32 bits; sin bucle ni llamada para las 5 del caso comun */
+static inline int csum_verify_ipv4(const void *hdr, unsigned int ihl)
+{
+    uint32_t w[5];
+    memcpy(w, hdr, sizeof(w));
+    uint64_t sum = (uint64_t)w[0] + w[1] + w[2] + w[3] + w[4];
+    if (ihl > 5)
+        sum = csum_partial((const uint8_t *)hdr + sizeof(w), (ihl - 5) * 4, sum);
+    return csum_fold(sum) == 0;
+}
+
+/* Pseudo-header de TCP/UDP como suma parcial; direcciones en orden de red */
+static inline uint64_t csum_pseudo_ipv4(uint32_t src, uint32_t dst, uint8_t proto, uint16_t len)
+{
+    return (uint64_t)src + dst + htons(proto) + htons(len);
+}
+
+/* RFC 1624: nuevo checksum tras cambiar un campo de 16 bits (en orden de red)
+   sin volver a recorrer los datos. HC' = ~(~HC + ~m + m') */
+static inline uint16_t csum_update16(uint16_t check, uint16_t old_value, uint16_t new_value)
+{
+    uint32_t sum = (uint16_t)~check + (uint16_t)~old_value + new_value;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/* Igual para un campo de 32 bits, p.ej. una direccion IPv4 */
+static inline uint16_t csum_update32(uint16_t check, uint32_t old_value, uint32_t new_value)
+{
+    check = csum_update16(check, (uint16_t)(old_value >> 16), (uint16_t)(new_value >> 16));
+    return csum_update16(check, (uint16_t)old_value, (uint16_t)new_value);
+}
+
+#endif
@@ -6,32 +6,83 @@
 #include "hal.h"
 #include "interface.h"
 
-#define NIC_DEFAULT_MTU  1500
 #define ETH_MAC_LEN      6
-#define ETH_HEADER_LEN   ETH_MAC_LEN * 2 + sizeof(uint16_t)
+#define ETH_HEADER_LEN   (ETH_MAC_LEN * 2 + sizeof(uint16_t))
+#define ETH_MAX_HANDLERS 16
+#define ETH_MAX_READERS  64     /* Hilos que despachan a la vez con periodo de gracia propio */
+#define ETH_VLAN_TAG_LEN 4
+#define ETH_VLAN_VID_MASK 0x0FFF
+#define ETH_MAX_VLANS    4096
 
 typedef enum ethertype {
     ethtype_IPv4 = 0x0800,
     ethtype_ARP = 0x0806,
     ethtype_IPv6 = 0x86DD,
     ethtype_ECTP = 0x9000,
+    ethtype_VLAN = 0x8100,
+    ethtype_QINQ = 0x88A8,
 } ethertype;
 
+typedef struct eth_vlan_tag {
+    uint16_t tci;
+    uint16_t ethertype;
+} __attribute__((packed)) eth_vlan_tag;
+
 typedef struct ethernet_frame {
     uint8_t dest_mac[ETH_MAC_LEN];
     uint8_t src_mac[ETH_MAC_LEN];
     uint16_t ethertype;
-    uint8_t payload[NIC_DEFAULT_MTU];
+    uint8_t payload[NIC_MAX_MTU];
 } __attribute__((packed)) ethernet_frame;
 
+/* MAC origen de una trama recibida: la cabecera sigue en el buffer tras quitarla */
+static inline const uint8_t * eth_src_mac(const nic_packet_t *pkt)
+{
+    return ((const ethernet_frame *)nic_packet_l2(pkt))->src_mac;
+}
+
 unsigned int eth_build_frame(ethernet_frame *frame, const uint8_t *src_mac,
                              const uint8_t *dst_mac, const uint16_t type,
                              const void *data, const uint16_t payload_len);
 
-int ethernet_send(nic_driver_t *drv, nic_device_t *nic, 
-                  ethernet_frame *frame, unsigned int length);
+/* Recibe el paquete con l3_off apuntando al payload Ethernet */
+typedef void (*eth_handler_t)(nic_packet_t *pkt, device_handle *dev, nic_driver_t *drv);
+/* Todas las tramas de un mismo ethertype llegadas en una ráfaga, en orden.
+ * Pueden venir de VLAN distintas, cada una trae la suya en vlan_id */
+typedef void (*eth_batch_handler_t)(nic_packet_t **pkts, unsigned int count,
+                                    device_handle *dev, nic_driver_t *drv);
+
+/* Bytes contados sin la cabecera Ethernet */
+typedef struct eth_type_stats {
+    unsigned long rx_packets;
+    unsigned long rx_bytes;
+    unsigned long tx_packets;
+    unsigned long tx_bytes;
+} eth_type_stats_t;
+
+int eth_register_handler(uint16_t type, eth_handler_t handler, eth_batch_handler_t batch_handler);
+
+int eth_unregister_handler(uint16_t type);
+
+int eth_get_type_stats(uint16_t type, eth_type_stats_t *stats);
+
+/* Direccion propia en cada VLAN, la 0 (sin etiqueta) usa dev->ip */
+int eth_vlan_bind(uint16_t vid, const uint8_t *ip);
+
+int eth_vlan_unbind(uint16_t vid);
+
+const uint8_t * eth_local_ip(device_handle *dev, uint16_t vid);
+
+int eth_vlan_insert(nic_packet_t *pkt, uint16_t tpid, uint16_t vid);
+
+nic_packet_t * eth_alloc_packet(nic_driver_t *drv, device_handle *dev);
+
+int ethernet_send(nic_driver_t *drv, device_handle *dev, nic_packet_t *pkt,
+                  const uint8_t *dst_mac, const uint16_t type);
+
+void ethernet_handle(nic_packet_t *pkt, device_handle *dev, nic_driver_t *drv);
 
-void ethernet_handle(const void *data, unsigned int length,
-                     device_handle *dev, nic_driver_t *drv);
+void ethernet_handle_batch(nic_packet_t *pkts, unsigned int count,
+                           device_handle *dev, nic_driver_t *drv);
 
 #endif
\ No newline at end of file
@@ -3,6 +3,21 @@
 
 #define HAL_IFACE_NAMELEN 32
 
+// TPACKET_V3 RX ring geometry
+#define HAL_RX_BLOCK_SIZE       (1 << 18)   // 256 KiB per block
+#define HAL_RX_BLOCK_COUNT      64
+#define HAL_RX_FRAME_SIZE       2048        // Nominal, V3 frames are variable length
+#define HAL_RX_BLOCK_TIMEOUT_MS 1           // Retire partially filled blocks after 1ms
+
+// 802.1Q tag put back in front of the ethertype when the kernel stripped it
+#define HAL_VLAN_TAG_LEN        4
+
+// Max frames handed to the kernel in a single sendmmsg()
+#define HAL_TX_BATCH_SIZE       64
+
+// PACKET_FANOUT balancing mode, hashing keeps every flow on one socket
+#define HAL_FANOUT_MODE         PACKET_FANOUT_HASH
+
 typedef struct device_handle {
     char name[HAL_IFACE_NAMELEN];
     int fd;
@@ -10,12 +25,52 @@ typedef struct device_handle {
     unsigned char mac[6];
     unsigned char ip[4];
     unsigned int mtu;
+
+    // NIC device driving this handle, set by the interface layer
+    void *owner;
+
+    // mmap'd RX ring, NULL when the kernel refused it (hal_receive is used then)
+    void *rx_ring;
+    unsigned int rx_ring_size;
+    unsigned int rx_block_size;
+    unsigned int rx_block_count;
+    unsigned int rx_block_index;
 } device_handle;
 
+// A block of frames handed over by the kernel, walked in place
+typedef struct hal_rx_block {
+    void *block;
+    unsigned int num_frames;
+    unsigned int frame_index;
+    void *next_frame;
+} hal_rx_block_t;
+
+// One frame of a batched send, sent holds the bytes accepted by the kernel
+typedef struct hal_tx_frame {
+    void *data;
+    unsigned int length;
+    unsigned int sent;
+} hal_tx_frame_t;
+
 void * hal_create_device();
 void hal_remove_device(void *handle);
 unsigned int hal_send(void * handle, void * data, unsigned int length);
+// Returns how many frames, from the first, the kernel dealt with: each one is sent
+// or failed on its own (sent < length). The rest found the socket buffer full and
+// are still to be sent
+unsigned int hal_send_batch(void *handle, hal_tx_frame_t *frames, unsigned int count);
 unsigned int hal_receive(void * handle, void * buffer, unsigned int buffer_length);
 void hal_get_mac_address(void * handle, unsigned char *mac);
 unsigned int hal_get_mtu(void * handle);
-#endif
\ No newline at end of file
+int hal_set_mtu(void * handle, unsigned int mtu);
+
+int hal_rx_ring_enabled(void *handle);
+int hal_get_fd(void *handle);
+int hal_join_fanout(void *handle, unsigned short group_id);
+int hal_set_busy_poll(void *handle, unsigned int usecs);
+int hal_set_qdisc_bypass(void *handle, int enable);
+int hal_rx_block_acquire(void *handle, hal_rx_block_t *block);
+int hal_rx_block_next_frame(hal_rx_block_t *block, void **data, unsigned int *length,
+                            unsigned long long *tstamp);
+void hal_rx_block_release(void *handle, hal_rx_block_t *block);
+#endif
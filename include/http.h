@@ -57,8 +57,8 @@ typedef void (*http_request_handler_t)(const http_request_t *request,
 void http_init(http_request_handler_t handler, void *user_data);
 
 
-void http_handler(struct device_handle *dev, tcp_conn_t *conn,
-                  const uint8_t *payload, int payload_len);
+void http_handler(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn,
+                  nic_packet_t *pkt);
 
 bool http_parse_request(const uint8_t *data, size_t len, http_request_t *request);
 
@@ -72,17 +72,17 @@ void http_response_set_body(http_response_t *response, const char *body, size_t
 
 int http_serialize_response(const http_response_t *response, uint8_t *buffer, size_t buffer_size);
 
-int http_send_response(struct device_handle *dev, tcp_conn_t *conn, 
+int http_send_response(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn, 
                        const http_response_t *response);
 
-void http_send_text(struct device_handle *dev, tcp_conn_t *conn,
+void http_send_text(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn,
                     int status_code, const char *status_text, const char *body);
 
-void http_send_html(struct device_handle *dev, tcp_conn_t *conn,
+void http_send_html(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn,
                     int status_code, const char *status_text, const char *html);
 
-void http_send_404(struct device_handle *dev, tcp_conn_t *conn);
+void http_send_404(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn);
 
-void http_send_500(struct device_handle *dev, tcp_conn_t *conn);
+void http_send_500(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn);
 
 #endif
\ No newline at end of file
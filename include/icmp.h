@@ -17,7 +17,7 @@ typedef struct {
 } __attribute__((packed)) icmp_hdr_t;
 
 /* Handler de recepción ICMP */
-void icmp_handler(uint8_t *packet, int len, device_handle *dev, 
+void icmp_handler(nic_packet_t *pkt, device_handle *dev, 
                   nic_driver_t *drv, uint32_t src_ip);
 
 /* Enviar Echo Reply (respuesta a ping) */
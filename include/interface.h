@@ -3,10 +3,23 @@
 
 #include <pthread.h>
 #include "hal.h"
+#include "packet.h"
 
 #define NIC_DEFAULT_MTU                 1500
-#define NIC_EXTRA_SIZE                  18  // Ethernet header + CRC 
+#define NIC_MIN_MTU                     68
+#define NIC_MAX_MTU                     9216    // Jumbo frames
+#define NIC_EXTRA_SIZE                  26  // Ethernet header + two VLAN tags (QinQ) + CRC
 #define NIC_DEFAULT_MAC                 {0x00, 0x1A, 0x2B, 0x3C, 0x4D, 0x5E}
+#define NIC_MAX_QUEUES                  16
+#define NIC_MAX_WORKERS                 (NIC_MAX_QUEUES + 1)    // Rx queues plus the optional tx worker
+#define NIC_DEFAULT_TX_RING_SIZE        1024    // Frames, rounded up to a power of two
+#define NIC_DEFAULT_RX_QUEUE_SIZE       256     // Frames, rounded up to a power of two
+#define NIC_RX_BATCH_SIZE               64      // Most frames handed to a batch callback at once
+#define NIC_DEFAULT_BUSY_POLL_USECS     50      // SO_BUSY_POLL per socket poll in adaptive mode
+#define NIC_DEFAULT_IDLE_USECS          1000    // Adaptive mode blocks again after this long without traffic
+#define NIC_MAX_CPUS                    1024
+#define NIC_TX_RETRY_USECS              100     // Retry held tx frames after ENOBUFS (no EPOLLOUT for it)
+#define NIC_ALL_QUEUES                  0xFFFFFFFFu
 
 #define NIC_IOCTL_CHANGE_MAC            0x01
 #define NIC_IOCTL_SET_MTU               0x02
@@ -21,61 +34,276 @@
 #define NIC_IOCTL_SET_PROMISCUOUS_MODE  0x0B
 #define NIC_IOCTL_UP                    0x0C
 #define NIC_IOCTL_DOWN                  0x0D
+#define NIC_IOCTL_GET_POOL_STATS        0x0E
+#define NIC_IOCTL_ADD_RX_PKT_CALLBACK   0x0F
+#define NIC_IOCTL_REMOVE_RX_PKT_CALLBACK 0x10
+#define NIC_IOCTL_GET_RX_QUEUE_STATS    0x11
+#define NIC_IOCTL_ADD_RX_BATCH_CALLBACK 0x12
+#define NIC_IOCTL_REMOVE_RX_BATCH_CALLBACK 0x13
+#define NIC_IOCTL_SET_POLL_MODE         0x14
+#define NIC_IOCTL_SET_RX_BUDGET         0x15
+#define NIC_IOCTL_SET_COALESCE          0x16
+#define NIC_IOCTL_SET_AFFINITY          0x17
+#define NIC_IOCTL_SET_SCHED             0x18
+#define NIC_IOCTL_GET_PLACEMENT         0x19
+#define NIC_IOCTL_ADD_TX_COMPLETION_CALLBACK    0x1A
+#define NIC_IOCTL_REMOVE_TX_COMPLETION_CALLBACK 0x1B
+#define NIC_IOCTL_SET_TIMER_CALLBACK    0x1C
 
 typedef enum {
     STATUS_OK = 0,
     STATUS_ERROR = -1,
     STATUS_NOT_SUPPORTED = -2,
     STATUS_INVALID_PARAM = -3,
+    STATUS_QUEUE_FULL = -4,
     // Additional status codes can be added here
 } status_t;
 
 typedef void (*nic_event_callback_t)(const void *data, unsigned int length);
+// Gets the received frame as a descriptor, only valid until the callback returns
+typedef void (*nic_packet_callback_t)(nic_packet_t *pkt);
+// Gets every frame drained in one wakeup (up to NIC_RX_BATCH_SIZE per call), in
+// arrival order with their timestamps, only valid until the callback returns
+typedef void (*nic_batch_callback_t)(nic_packet_t *pkts, unsigned int count);
 
-typedef struct nic_callback {
-    nic_event_callback_t callback;
-    struct nic_callback *next;
-} nic_callback_t;
+// Outcome of one frame queued with send_pkt_async
+typedef struct nic_tx_completion {
+    void *cookie;
+    status_t status;            // STATUS_OK once on the wire, STATUS_ERROR if the send failed or was cancelled
+    unsigned long long tstamp;  // When the send returned, ns (CLOCK_REALTIME)
+} nic_tx_completion_t;
+// Gets the completions of one tx batch in send order, the array is only valid
+// until the callback returns
+typedef void (*nic_tx_completion_callback_t)(const nic_tx_completion_t *completions, unsigned int count);
+// Run by the tx worker after every round, it may send. Returns the ms until it has
+// work again, which bounds the worker's next wait, or -1 when nothing is pending
+typedef int (*nic_timer_callback_t)(void);
 
+// Immutable snapshot of a callback list. Registering or removing a callback
+// publishes a new table, the old one is freed once no worker can still read it.
+typedef struct nic_callback_table {
+    unsigned int count;
+    struct nic_callback_table *retired_next;
+    nic_event_callback_t callbacks[];
+} nic_callback_table_t;
+
+// Protocols with their own rx/tx counters
+typedef enum {
+    NIC_PROTO_ARP = 0,
+    NIC_PROTO_IPV4,
+    NIC_PROTO_ICMP,
+    NIC_PROTO_TCP,
+    NIC_PROTO_UDP,
+    NIC_PROTO_COUNT
+} nic_proto_t;
+
+// Every field is an unsigned long counter, they are summed field by field
 typedef struct nic_stats {
     unsigned long tx_packets;
     unsigned long rx_packets;
+    unsigned long tx_bytes;
+    unsigned long rx_bytes;
     unsigned long tx_errors;
     unsigned long rx_errors;
-    unsigned long collisions;
+    unsigned long tx_dropped;           // Tx ring full
+    unsigned long tx_dropped_nobuf;     // No pool buffer for an outgoing packet
+    unsigned long tx_dropped_unresolved; // Waited for an ARP reply that never came, or its hold queue was full
+    unsigned long rx_dropped_full;      // Rx queue full, the new frame was dropped
+    unsigned long rx_dropped_oldest;    // Rx queue full, the oldest frame was evicted
+    unsigned long rx_dropped_nobuf;     // No pool buffer to queue the frame
+    // Frames dropped by the protocol stack
+    unsigned long rx_dropped_short;
+    unsigned long rx_dropped_not_for_me;
+    unsigned long rx_dropped_bad_checksum;
+    unsigned long rx_dropped_bad_header;    // IPv4 version, IHL or total length inconsistent
+    unsigned long rx_dropped_fragment;      // IPv4 fragments, there is no reassembly
+    unsigned long rx_dropped_unknown_ethertype;
+    unsigned long rx_dropped_vlan;      // Tagged with a VLAN that has no address bound
+    unsigned long rx_dropped_arp_storm; // ARP over its per-source or global rate limit
+    unsigned long tx_arp_suppressed;    // ARP requests not sent, over the outgoing rate limit
+    unsigned long rx_proto[NIC_PROTO_COUNT];
+    unsigned long tx_proto[NIC_PROTO_COUNT];
     // Additional statistics fields can be added here
 } nic_stats_t;
 
-typedef struct nic_buffer {
-    void *data;
-    unsigned int length;
-    struct nic_buffer *next;
-} nic_buffer_t;
+// What a full rx queue does with one more frame
+typedef enum {
+    NIC_RX_DROP_NEWEST = 0,         // Drop the incoming frame
+    NIC_RX_DROP_OLDEST,             // Evict the oldest queued frame to make room
+    NIC_RX_CALLBACKS_ONLY,          // Skip the queue while rx callbacks are registered, else drop newest
+} nic_rx_overflow_t;
+
+typedef struct nic_rx_queue_stats {
+    unsigned long capacity;
+    unsigned long depth;
+    unsigned long high_watermark;   // Deepest the queue got since init or NIC_IOCTL_RESET_STATS
+} nic_rx_queue_stats_t;
+
+// How workers wait for traffic
+typedef enum {
+    NIC_POLL_BLOCKING = 0,          // Sleep in epoll until the socket or the tx eventfd fires
+    NIC_POLL_ADAPTIVE,              // Busy-poll while traffic flows, block after idle_usecs without any
+} nic_poll_mode_t;
+
+typedef struct nic_poll_params {
+    nic_poll_mode_t mode;
+    unsigned int busy_poll_usecs;   // 0 means NIC_DEFAULT_BUSY_POLL_USECS
+    unsigned int idle_usecs;        // 0 means NIC_DEFAULT_IDLE_USECS
+} nic_poll_params_t;
+
+// Blocking mode: a wakeup that handled fewer than max_frames frames holds off the
+// next wait for max_usecs, so the following wakeup carries more. 0 usecs disables it.
+// Only RX is held back, a tx kick ends the hold-off early.
+typedef struct nic_coalesce {
+    unsigned int max_frames;
+    unsigned int max_usecs;
+} nic_coalesce_t;
+
+// Set of CPUs, bit n stands for CPU n
+typedef struct nic_cpu_mask {
+    unsigned long long bits[NIC_MAX_CPUS / 64];
+} nic_cpu_mask_t;
+
+static inline void nic_cpu_mask_set(nic_cpu_mask_t *mask, unsigned int cpu) {
+    if (cpu < NIC_MAX_CPUS) mask->bits[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+static inline int nic_cpu_mask_isset(const nic_cpu_mask_t *mask, unsigned int cpu) {
+    return cpu < NIC_MAX_CPUS && (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+// NIC_IOCTL_SET_AFFINITY: pin one worker (or NIC_ALL_QUEUES) to a set of CPUs
+typedef struct nic_affinity {
+    unsigned int queue;
+    nic_cpu_mask_t cpus;
+} nic_affinity_t;
+
+// NIC_IOCTL_SET_SCHED: SCHED_OTHER (priority 0) or SCHED_FIFO for every worker
+typedef struct nic_sched {
+    int policy;
+    int priority;
+} nic_sched_t;
+
+// NIC_IOCTL_GET_PLACEMENT: where each worker actually is
+typedef struct nic_queue_placement {
+    int tid;                    // 0 while the device is down
+    int cpu;                    // Last CPU the worker ran on, -1 when unknown
+    nic_cpu_mask_t cpus;        // Effective affinity
+    int policy;
+    int priority;
+} nic_queue_placement_t;
+
+// Rx queues first, then the tx worker when config.tx_thread is set
+typedef struct nic_placement {
+    unsigned int num_queues;
+    nic_queue_placement_t queues[NIC_MAX_WORKERS];
+} nic_placement_t;
+
+typedef struct nic_config {
+    unsigned int rx_queues;     // Packet sockets in the fanout group, 0 means 1
+    unsigned int tx_ring_size;  // Slots in the tx ring, 0 means NIC_DEFAULT_TX_RING_SIZE
+    unsigned int rx_queue_size; // Frames held for nic_receive_packet, 0 means NIC_DEFAULT_RX_QUEUE_SIZE
+    nic_rx_overflow_t rx_overflow;
+    unsigned int pool_size;     // Preallocated frame buffers, 0 means NIC_POOL_DEFAULT_SIZE
+    int pool_hugepages;         // Back the buffer pool with hugepages when available
+    nic_poll_params_t poll;     // Also NIC_IOCTL_SET_POLL_MODE
+    unsigned int rx_budget;     // Rx frames per worker round, 0 means no limit. Also NIC_IOCTL_SET_RX_BUDGET
+    nic_coalesce_t coalesce;    // Also NIC_IOCTL_SET_COALESCE
+    int tx_thread;              // Flush the tx ring from a dedicated worker instead of queue 0
+    unsigned int max_mtu;       // Largest MTU NIC_IOCTL_SET_MTU can set later, 0 means the device MTU
+} nic_config_t;
+
+struct nic_device;
+struct nic_ring;
+struct nic_pool;
+
+// Counters of one thread for one device. Only the owning thread writes them,
+// readers sum every shard under the device stats lock.
+typedef struct nic_stats_shard {
+    nic_stats_t stats;
+    struct nic_device *device;
+    struct nic_stats_shard *next;
+} __attribute__((aligned(64))) nic_stats_shard_t;
+
+// One packet socket and the worker draining it. Queue 0 also owns transmission,
+// unless a dedicated tx worker (no socket of its own) follows the rx queues
+typedef struct nic_queue {
+    struct nic_device *device;
+    unsigned int index;
+    void *hw_handle;
+    pthread_t thread;
+
+    // Ring block cut short by the rx budget, resumed next round
+    hal_rx_block_t rx_block;
+    // Adaptive mode: when the worker last found work (CLOCK_MONOTONIC ns)
+    unsigned long long last_work;
+
+    // Placement requested through NIC_IOCTL_SET_AFFINITY, kept across down/up
+    int tid;
+    int pinned;
+    nic_cpu_mask_t cpus;
+
+    // Odd while the worker is dispatching callbacks, writers wait for it to move
+    unsigned long rcu_epoch;
+
+    // Wakes the worker when tx frames are queued or the device goes down
+    int event_fd;
+    // What the worker currently waits for on its socket (EPOLLIN, EPOLLOUT)
+    unsigned int socket_events;
+} nic_queue_t;
 
 typedef struct nic_device {
     char name[32];
     unsigned char mac_address[6];
     unsigned int mtu;
+    unsigned int max_mtu;       // Frame buffers are sized for it, fixed by nic_init
     unsigned short promiscuous_mode;
 
-    // Callback lists triggered on events
-    nic_callback_t *rx_callbacks;
-    nic_callback_t *tx_callbacks;
-    nic_callback_t *error_callbacks;
+    // Callback tables triggered on events, NULL when empty. callback_lock only
+    // serializes writers, retired tables wait there for their grace period
+    nic_callback_table_t *rx_callbacks;
+    nic_callback_table_t *rx_pkt_callbacks;
+    nic_callback_table_t *rx_batch_callbacks;
+    nic_callback_table_t *tx_callbacks;
+    nic_callback_table_t *tx_completion_callbacks;
+    nic_callback_table_t *error_callbacks;
+    nic_callback_table_t *retired_callbacks;
+    pthread_mutex_t callback_lock;
+    nic_timer_callback_t timer_callback;    // One at most, NULL when unset
 
-    // Statistics
-    nic_stats_t stats;
+    // Settings read by nic_init, zeroed fields take the defaults
+    nic_config_t config;
 
-    // Internal buffers for rx and tx
-    nic_buffer_t *rx_buffer;
-    nic_buffer_t *tx_buffer;
+    // Bounded rx queue for nic_receive_packet (workers enqueue, rx_lock serializes readers)
+    // and lock-free tx ring (any thread enqueues, the tx queue drains)
+    struct nic_ring *rx_ring;
+    nic_packet_t *rx_pending;
+    pthread_mutex_t rx_lock;
+    unsigned long rx_high_watermark;
+    struct nic_ring *tx_ring;
+    struct nic_pool *pool;
 
-    // Internal hardware device handle
+    // Internal hardware device handle (the one of queue 0)
     void *hw_handle;
 
-    // Internal status and thread
+    // Per-thread counter shards, what exited threads counted and the last reset point
+    nic_stats_shard_t *stats_shards;
+    nic_stats_t stats_retired;
+    nic_stats_t stats_base;
+    pthread_mutex_t stats_lock;
+
+    // Internal status and receive queues, each with its own worker
     int is_up;
-    pthread_t thread;
+    unsigned int num_queues;
+    unsigned int num_workers;   // num_queues, plus one with the tx worker
+    unsigned int tx_queue;      // Worker flushing the tx ring
+    nic_queue_t queues[NIC_MAX_WORKERS];
+    int tx_kick_pending;
+    // Frames the socket had no room for, sent first by the next flush (tx queue only)
+    nic_packet_t *tx_backlog[HAL_TX_BATCH_SIZE];
+    unsigned int tx_backlog_count;
+    int tx_backlog_errno;       // Why they were held: EAGAIN waits for EPOLLOUT
+    nic_sched_t sched;
 
     // Additional device-specific fields can be added here
     // ...
@@ -86,8 +314,35 @@ typedef struct nic_driver {
     status_t (*shutdown)(nic_device_t *device);
     status_t (*send_packet)(nic_device_t *device, const void *data, unsigned int length);
     status_t (*receive_packet)(nic_device_t *device, void *buffer, unsigned int buffer_length);
+    // Zero-copy path: packets come from alloc_packet and send_pkt takes ownership
+    nic_packet_t * (*alloc_packet)(nic_device_t *device);
+    status_t (*send_pkt)(nic_device_t *device, nic_packet_t *pkt);
+    // Same, plus a tx completion reporting cookie once the frame has left. The packet
+    // may also wrap caller memory (nic_packet_wrap), which must then stay untouched
+    // until the completion arrives. When the call fails the packet is released and
+    // nothing is reported.
+    status_t (*send_pkt_async)(nic_device_t *device, nic_packet_t *pkt, void *cookie);
     status_t (*ioctl)(nic_device_t *device, unsigned int command, void *arg);
 } nic_driver_t;
 
 nic_driver_t * nic_get_driver();
+
+extern __thread nic_stats_shard_t __nic_thread_stats;
+nic_stats_t * __nic_stats_bind(nic_device_t *device);
+
+// Counters of the calling thread, bound to the device on first use
+static inline nic_stats_t * nic_stats_local(nic_device_t *device) {
+    if (__builtin_expect(__nic_thread_stats.device == device, 1)) {
+        return &__nic_thread_stats.stats;
+    }
+    return __nic_stats_bind(device);
+}
+
+// No lock prefix needed, the owner is the only writer. The relaxed store keeps
+// concurrent readers from seeing a torn value.
+#define NIC_STATS_ADD(device, field, n) do { \
+        nic_stats_t *__stats = nic_stats_local(device); \
+        __atomic_store_n(&__stats->field, __stats->field + (n), __ATOMIC_RELAXED); \
+    } while (0)
+
 #endif
\ No newline at end of file
@@ -9,7 +9,10 @@
 #define IPV4_PROTO_TCP  6
 #define IPV4_PROTO_UDP  17
 #define IPV4_HEADER_LEN 20
+#define IPV4_MAX_HEADER_LEN 60
 #define IPV4_VERSION    4
+#define IPV4_FLAG_MF    0x2000      /* En flags_frag, orden de host */
+#define IPV4_FRAG_MASK  0x1FFF
 
 typedef struct {
     uint8_t  ver_ihl;
@@ -24,8 +27,8 @@ typedef struct {
     uint32_t dst;
 } __attribute__((packed)) ipv4_hdr_t;
 
-void ipv4_handler(uint8_t *packet, int len, device_handle *dev, nic_driver_t *drv);
+void ipv4_handler(nic_packet_t *pkt, device_handle *dev, nic_driver_t *drv);
 int  ipv4_send(device_handle *dev, nic_driver_t *drv, uint32_t dst, uint8_t proto,
-               const uint8_t *payload, uint16_t payload_len);
+               nic_packet_t *pkt);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,148 @@
+#ifndef _NIC_LOG_H
+#define _NIC_LOG_H
+
+#include <stdio.h>
+
+#define NIC_LOG_LEVEL_DEBUG     0
+#define NIC_LOG_LEVEL_INFO      1
+#define NIC_LOG_LEVEL_WARN      2
+#define NIC_LOG_LEVEL_ERROR     3
+#define NIC_LOG_LEVEL_NONE      4
+
+// Call sites below this level compile to nothing (make LOG_LEVEL=n)
+#ifndef NIC_LOG_MIN_LEVEL
+#define NIC_LOG_MIN_LEVEL       NIC_LOG_LEVEL_DEBUG
+#endif
+
+#define NIC_LOG_RING_SIZE       1024    // Records per thread, a power of two
+#define NIC_LOG_MAX_ARGS        12
+#define NIC_LOG_RECORD_SIZE     256     // Strings are cut to what is left of it
+#define NIC_LOG_FLUSH_USECS     1000    // Formatter sleep when every ring is empty
+
+typedef enum {
+    NIC_LOG_NIC = 0,
+    NIC_LOG_ETH,
+    NIC_LOG_ARP,
+    NIC_LOG_IPV4,
+    NIC_LOG_ICMP,
+    NIC_LOG_TCP,
+    NIC_LOG_HTTP,
+    NIC_LOG_DHCP,
+    NIC_LOG_APP,
+    NIC_LOG_MODULE_COUNT
+} nic_log_module_t;
+
+enum {
+    __NIC_LOG_INT = 0,
+    __NIC_LOG_DOUBLE,
+    __NIC_LOG_STR,
+    __NIC_LOG_PTR
+};
+
+// One message as the producer left it: the format string (a literal, so it
+// outlives the record) and the raw arguments, formatted later by the log thread
+typedef struct nic_log_record {
+    unsigned long long tstamp;
+    const char *fmt;
+    unsigned char level;
+    unsigned char module;
+    unsigned char nargs;
+    unsigned char used;             // Bytes of data taken by copied strings
+    unsigned char types[NIC_LOG_MAX_ARGS];
+    union {
+        unsigned long long u;
+        double d;
+        const void *p;
+    } args[NIC_LOG_MAX_ARGS];
+    char data[NIC_LOG_RECORD_SIZE - 20 - NIC_LOG_MAX_ARGS * 9];  // Fixed fields take 20 bytes
+} nic_log_record_t;
+
+extern unsigned char __nic_log_levels[NIC_LOG_MODULE_COUNT];
+
+nic_log_record_t * __nic_log_begin(int level, nic_log_module_t module);
+void __nic_log_commit(nic_log_record_t *record);
+void __nic_log_str(nic_log_record_t *record, const char *value);
+
+static inline int __nic_log_on(nic_log_module_t module, int level) {
+    return level >= __atomic_load_n(&__nic_log_levels[module], __ATOMIC_RELAXED);
+}
+
+static inline void __nic_log_int(nic_log_record_t *record, unsigned long long value) {
+    if (record->nargs < NIC_LOG_MAX_ARGS) {
+        record->types[record->nargs] = __NIC_LOG_INT;
+        record->args[record->nargs++].u = value;
+    }
+}
+
+static inline void __nic_log_double(nic_log_record_t *record, double value) {
+    if (record->nargs < NIC_LOG_MAX_ARGS) {
+        record->types[record->nargs] = __NIC_LOG_DOUBLE;
+        record->args[record->nargs++].d = value;
+    }
+}
+
+static inline void __nic_log_ptr(nic_log_record_t *record, const void *value) {
+    if (record->nargs < NIC_LOG_MAX_ARGS) {
+        record->types[record->nargs] = __NIC_LOG_PTR;
+        record->args[record->nargs++].p = value;
+    }
+}
+
+// Strings are copied into the record, anything else is stored as its bits
+#define __NIC_LOG_ARG(record, x) _Generic((x), \
+        char *: __nic_log_str, const char *: __nic_log_str, \
+        void *: __nic_log_ptr, const void *: __nic_log_ptr, \
+        unsigned char *: __nic_log_ptr, const unsigned char *: __nic_log_ptr, \
+        float: __nic_log_double, double: __nic_log_double, \
+        default: __nic_log_int)(record, x)
+
+#define __NIC_LOG_COUNT(...) __NIC_LOG_COUNT_(_, ##__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define __NIC_LOG_COUNT_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, N, ...) N
+#define __NIC_LOG_CAT(a, b) __NIC_LOG_CAT_(a, b)
+#define __NIC_LOG_CAT_(a, b) a##b
+
+#define __NIC_LOG_ARGS_0(r)
+#define __NIC_LOG_ARGS_1(r, a) __NIC_LOG_ARG(r, a);
+#define __NIC_LOG_ARGS_2(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_1(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_3(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_2(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_4(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_3(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_5(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_4(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_6(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_5(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_7(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_6(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_8(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_7(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_9(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_8(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_10(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_9(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_11(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_10(r, __VA_ARGS__)
+#define __NIC_LOG_ARGS_12(r, a, ...) __NIC_LOG_ARG(r, a); __NIC_LOG_ARGS_11(r, __VA_ARGS__)
+
+// A disabled level is a constant false condition, the arguments are never
+// evaluated and the whole statement is dropped by the compiler
+#define NIC_LOG(level, module, format, ...) do { \
+        if ((level) >= NIC_LOG_MIN_LEVEL && __nic_log_on(module, level)) { \
+            nic_log_record_t *__record = __nic_log_begin(level, module); \
+            if (__record) { \
+                __record->fmt = (format); \
+                __NIC_LOG_CAT(__NIC_LOG_ARGS_, __NIC_LOG_COUNT(__VA_ARGS__))(__record, ##__VA_ARGS__) \
+                __nic_log_commit(__record); \
+            } \
+        } \
+    } while (0)
+
+#define NIC_LOG_DEBUG(module, ...)  NIC_LOG(NIC_LOG_LEVEL_DEBUG, module, __VA_ARGS__)
+#define NIC_LOG_INFO(module, ...)   NIC_LOG(NIC_LOG_LEVEL_INFO, module, __VA_ARGS__)
+#define NIC_LOG_WARN(module, ...)   NIC_LOG(NIC_LOG_LEVEL_WARN, module, __VA_ARGS__)
+#define NIC_LOG_ERROR(module, ...)  NIC_LOG(NIC_LOG_LEVEL_ERROR, module, __VA_ARGS__)
+
+// Runtime threshold per module (NIC_LOG_LEVEL_INFO by default)
+void nic_log_set_level(nic_log_module_t module, int level);
+int nic_log_get_level(nic_log_module_t module);
+// Where the log thread writes, stdout by default
+void nic_log_set_output(FILE *output);
+// Wait until every record committed so far has been written
+void nic_log_flush(void);
+// Flush and stop the log thread, logging starts it again when needed
+void nic_log_shutdown(void);
+// Records lost because a thread's ring was full
+unsigned long nic_log_dropped(void);
+
+#endif
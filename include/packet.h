@@ -0,0 +1,104 @@
+#ifndef _NIC_PACKET_H
+#define _NIC_PACKET_H
+
+#include <stddef.h>
+
+#define NIC_PKT_HEADROOM        192     // Room for every header the TX path prepends
+#define NIC_PKT_F_EXTERNAL      0x01    // Data lives outside the pool (rx ring), valid during the callback only
+#define NIC_PKT_F_NOTIFY        0x02    // Report a tx completion carrying the cookie
+
+struct nic_pool;
+
+// Packet descriptor shared by every layer. Pool packets keep the descriptor at
+// the head of their buffer, followed by headroom and the frame itself. Layer
+// offsets are relative to head and filled in by each RX layer as it parses.
+typedef struct nic_packet {
+    struct nic_pool *pool;
+    struct nic_packet *next;
+    unsigned int refcnt;
+    unsigned int flags;
+    unsigned char *head;
+    unsigned int capacity;
+    unsigned int data_off;
+    unsigned int len;
+    unsigned short l2_off;
+    unsigned short l3_off;
+    unsigned short l4_off;
+    unsigned short l7_off;
+    unsigned long long tstamp;      // Receive time in ns (CLOCK_REALTIME), 0 when not received
+    void *cookie;                   // Caller tag echoed in the tx completion
+    unsigned short vlan_id;         // 802.1Q VID stripped on rx / tagged on tx, 0 when untagged
+    unsigned short outer_vlan_id;   // Service tag of a QinQ frame, 0 when single tagged
+} __attribute__((aligned(64))) nic_packet_t;
+
+nic_packet_t * nic_packet_alloc(struct nic_pool *pool, unsigned int headroom);
+nic_packet_t * nic_packet_copy(struct nic_pool *pool, const nic_packet_t *src);
+void nic_packet_wrap(nic_packet_t *pkt, void *data, unsigned int length);
+void nic_packet_release(nic_packet_t *pkt);
+
+static inline void nic_packet_ref(nic_packet_t *pkt) {
+    __atomic_fetch_add(&pkt->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned char * nic_packet_data(const nic_packet_t *pkt) {
+    return pkt->head + pkt->data_off;
+}
+
+static inline unsigned int nic_packet_headroom(const nic_packet_t *pkt) {
+    return pkt->data_off;
+}
+
+static inline unsigned int nic_packet_tailroom(const nic_packet_t *pkt) {
+    return pkt->capacity - pkt->data_off - pkt->len;
+}
+
+// Grow the packet at the front (TX headers), NULL when the headroom is exhausted
+static inline unsigned char * nic_packet_prepend(nic_packet_t *pkt, unsigned int length) {
+    if (length > pkt->data_off) {
+        return NULL;
+    }
+    pkt->data_off -= length;
+    pkt->len += length;
+    return nic_packet_data(pkt);
+}
+
+// Grow the packet at the end, returns the start of the new area
+static inline unsigned char * nic_packet_append(nic_packet_t *pkt, unsigned int length) {
+    if (length > nic_packet_tailroom(pkt)) {
+        return NULL;
+    }
+    unsigned char *tail = nic_packet_data(pkt) + pkt->len;
+    pkt->len += length;
+    return tail;
+}
+
+// Strip a parsed header from the front (RX), NULL when the packet is shorter
+static inline unsigned char * nic_packet_pull(nic_packet_t *pkt, unsigned int length) {
+    if (length > pkt->len) {
+        return NULL;
+    }
+    pkt->data_off += length;
+    pkt->len -= length;
+    return nic_packet_data(pkt);
+}
+
+// Drop trailing bytes (e.g. Ethernet padding past the IP total length)
+static inline void nic_packet_trim(nic_packet_t *pkt, unsigned int length) {
+    if (length < pkt->len) {
+        pkt->len = length;
+    }
+}
+
+static inline unsigned char * nic_packet_l2(const nic_packet_t *pkt) {
+    return pkt->head + pkt->l2_off;
+}
+
+static inline unsigned char * nic_packet_l3(const nic_packet_t *pkt) {
+    return pkt->head + pkt->l3_off;
+}
+
+static inline unsigned char * nic_packet_l4(const nic_packet_t *pkt) {
+    return pkt->head + pkt->l4_off;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _NIC_POOL_H
+#define _NIC_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define NIC_POOL_DEFAULT_SIZE   4096    // Buffers preallocated by nic_init
+#define NIC_POOL_CACHE_SIZE     64      // Buffers a thread keeps for itself
+#define NIC_POOL_CACHE_BATCH    32      // Buffers moved per refill / flush
+#define NIC_POOL_ALIGN          64
+#define NIC_POOL_HUGEPAGE_SIZE  (2UL * 1024 * 1024)
+
+typedef struct nic_pool_stats {
+    unsigned int buffer_count;
+    unsigned int buffer_size;
+    unsigned int free_buffers;      // In the shared free list, thread caches excluded
+    int hugepages;
+    unsigned long exhausted;        // Allocations that found the pool empty
+} nic_pool_stats_t;
+
+struct nic_pool_cache;
+
+// Fixed-size buffers carved out of one mapping. Threads allocate from and free to
+// a private cache, the shared free list is only locked once per batch.
+typedef struct nic_pool {
+    unsigned char *memory;
+    size_t memory_size;
+    unsigned int buffer_size;
+    unsigned int buffer_count;
+    int hugepages;
+
+    pthread_mutex_t lock;
+    void **free_list;
+    unsigned int free_count;
+    struct nic_pool_cache *caches;  // Thread caches currently bound to this pool
+
+    unsigned long exhausted;
+} nic_pool_t;
+
+nic_pool_t * nic_pool_create(unsigned int buffer_count, unsigned int buffer_size, int use_hugepages);
+void nic_pool_destroy(nic_pool_t *pool);
+void * nic_pool_alloc(nic_pool_t *pool);
+void nic_pool_free(nic_pool_t *pool, void *buffer);
+void nic_pool_get_stats(nic_pool_t *pool, nic_pool_stats_t *stats);
+
+#endif
@@ -14,6 +14,12 @@
 
 #define TCP_PROTO_IP    6
 
+#define TCP_OPT_END     0
+#define TCP_OPT_NOP     1
+#define TCP_OPT_MSS     2
+#define TCP_OPT_MSS_LEN 4
+#define TCP_DEFAULT_MSS 536     /* Si el SYN no trae la opción (RFC 9293) */
+
 typedef struct {
     uint16_t src_port;
     uint16_t dst_port;
@@ -33,13 +39,17 @@ typedef struct {
     uint16_t local_port;
     uint32_t seq;
     uint32_t ack;
+    uint16_t mss;       /* Segmento máximo de envío: el menor entre el del par y el nuestro */
     uint8_t  state;
 } tcp_conn_t;
 
-void tcp_handler(uint8_t *packet, int len, struct device_handle *dev, nic_driver_t *drv,
+/* MSS que cabe en la MTU actual del dispositivo */
+uint16_t tcp_local_mss(struct device_handle *dev);
+void tcp_handler(nic_packet_t *pkt, struct device_handle *dev, nic_driver_t *drv,
                  uint32_t src_ip, uint32_t dst_ip);
+/* pkt lleva el payload (o NULL si no hay datos), tcp_send se queda con él */
 int tcp_send(struct device_handle *dev, nic_driver_t *drv, uint32_t dst_ip, uint16_t src_port,
              uint16_t dst_port, uint32_t seq, uint32_t ack,
-             uint8_t flags, const uint8_t *payload, uint16_t payload_len);
+             uint8_t flags, nic_packet_t *pkt);
 
 #endif
\ No newline at end of file
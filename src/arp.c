@@ -1,83 +1,611 @@
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include "arp.h"
 #include "ethernet.h"
+#include "log.h"
 
-static uint8_t cache_ip[4] = {0};
-static uint8_t cache_mac[6] = {0};
-static int cache_valid = 0;
+/* Vecinos en una tabla de direccionamiento abierto: una IP vive en alguno de
+   los ARP_PROBE_WINDOW huecos que siguen a su hash. Las busquedas recorren la
+   ventana sin cerrojos (seqlock por entrada), las inserciones se serializan y
+   ocupan un hueco libre o caducado o desalojan al menos usado de la ventana. */
+typedef struct arp_entry {
+    uint32_t seq;           /* Impar mientras se reescribe */
+    uint32_t ip;            /* Orden de red, 0 si esta libre */
+    uint8_t  mac[6];
+    uint16_t pad;
+    uint32_t confirmed;     /* ms de la ultima vez que el vecino hablo */
+    uint32_t used;          /* ms del ultimo envio hacia el (LRU) */
+    uint32_t probed;        /* ms de la ultima peticion de refresco */
+    uint32_t pad2;
+} arp_entry_t;
+
+static arp_entry_t arp_table[ARP_TABLE_SIZE] __attribute__((aligned(64)));
+static pthread_mutex_t arp_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long arp_evictions;
+
+/* Resolucion en curso: los paquetes esperan encadenados por pkt->next */
+typedef struct arp_pending {
+    uint32_t ip;            /* 0 si el hueco esta libre */
+    uint8_t sender_ip[4];
+    uint16_t vlan_id;       /* VLAN por la que se pregunta, la del primer paquete */
+    uint16_t outer_vlan_id;
+    device_handle *dev;
+    nic_driver_t *drv;
+    nic_packet_t *head;
+    nic_packet_t *tail;
+    unsigned int count;
+    unsigned int requests;
+    uint32_t last_request;
+} arp_pending_t;
+
+/* Cubos de fichas: fichas en los 32 bits altos, ms de la ultima recarga en los bajos */
+static uint64_t arp_rx_bucket;
+static uint64_t arp_tx_bucket;
+static uint64_t arp_source_buckets[ARP_SOURCE_BUCKETS];
+
+static arp_pending_t arp_pending[ARP_PENDING_NEIGHBORS];
+static unsigned int arp_pending_count;
+static pthread_mutex_t arp_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reloj en ms de 32 bits, las edades se calculan con resta sin signo */
+static inline uint32_t arp_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Recarga segun el tiempo pasado y gasta una ficha, 0 si no queda ninguna */
+static int arp_bucket_take(uint64_t *bucket, uint32_t rate, uint32_t burst, uint32_t now)
+{
+    uint64_t old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+    for (;;) {
+        uint32_t tokens = old >> 32;
+        uint32_t stamp = (uint32_t)old;
+        uint64_t add = (uint64_t)(now - stamp) * rate / 1000;
+        if (tokens + add >= burst) {
+            tokens = burst;
+            stamp = now;
+        } else if (add) {
+            tokens += add;
+            stamp += add * 1000 / rate;  /* Lo que sobra de ficha cuenta para la siguiente */
+        }
+        if (!tokens)
+            return 0;
+        uint64_t next = ((uint64_t)(tokens - 1) << 32) | stamp;
+        if (__atomic_compare_exchange_n(bucket, &old, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
+    }
+}
+
+/* Devuelve una ficha gastada sin llegar a usarse, sin pasar de burst */
+static void arp_bucket_refund(uint64_t *bucket, uint32_t burst)
+{
+    uint64_t old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+    while ((old >> 32) < burst &&
+           !__atomic_compare_exchange_n(bucket, &old, old + (1ULL << 32), 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline uint32_t arp_hash(uint32_t key)
+{
+    return (key * 0x9E3779B1u) >> 16;
+}
+
+static inline arp_entry_t *arp_slot(uint32_t base, unsigned int i)
+{
+    return &arp_table[(base + i) & (ARP_TABLE_SIZE - 1)];
+}
+
+/* Copia MAC y confirmacion si la entrada es de key, 0 si no lo es.
+   seq_out (si no es NULL) recibe la version leida */
+static int arp_read(const arp_entry_t *e, uint32_t key, uint8_t *mac, uint32_t *confirmed,
+                    uint32_t *seq_out)
+{
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;  /* El escritor tarda unos pocos stores */
+        if (__atomic_load_n(&e->ip, __ATOMIC_RELAXED) != key)
+            return 0;
+        memcpy(mac, e->mac, 6);
+        *confirmed = __atomic_load_n(&e->confirmed, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq) {
+            if (seq_out)
+                *seq_out = seq;
+            return 1;
+        }
+    }
+}
+
+/* Pasa seq de par a impar si sigue valiendo expected (o cualquier par si
+   expected es NULL). Los escritores y arp_confirm se excluyen asi entre ellos */
+static int arp_seq_begin(arp_entry_t *e, const uint32_t *expected)
+{
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+        if (expected && seq != *expected)
+            return 0;
+        if (!(seq & 1) &&
+            __atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+}
+
+static inline void arp_seq_end(arp_entry_t *e)
+{
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Solo con arp_write_lock */
+static void arp_write(arp_entry_t *e, uint32_t key, const uint8_t *mac, uint32_t now)
+{
+    arp_seq_begin(e, NULL);
+    __atomic_store_n(&e->ip, key, __ATOMIC_RELAXED);
+    memcpy(e->mac, mac, 6);
+    __atomic_store_n(&e->confirmed, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->used, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->probed, now - ARP_PROBE_INTERVAL_MS, __ATOMIC_RELAXED);
+    arp_seq_end(e);
+}
 
 int arp_lookup(const uint8_t *ip, uint8_t *out_mac)
 {
-    if (cache_valid && memcmp(ip, cache_ip, 4) == 0) {
-        memcpy(out_mac, cache_mac, 6);
-        return 0;  /* Éxito */
+    uint32_t key;
+    memcpy(&key, ip, 4);
+    if (!key)
+        return ARP_LOOKUP_MISS;
+
+    uint32_t now = arp_now_ms();
+    uint32_t base = arp_hash(key);
+    for (unsigned int i = 0; i < ARP_PROBE_WINDOW; i++) {
+        arp_entry_t *e = arp_slot(base, i);
+        uint8_t mac[6];
+        uint32_t confirmed;
+        if (!arp_read(e, key, mac, &confirmed, NULL))
+            continue;
+        uint32_t age = now - confirmed;
+        if (age >= ARP_STALE_MS)
+            return ARP_LOOKUP_MISS;  /* Caducada */
+        memcpy(out_mac, mac, 6);
+        if (now - __atomic_load_n(&e->used, __ATOMIC_RELAXED) >= ARP_USED_GRANULARITY_MS)
+            __atomic_store_n(&e->used, now, __ATOMIC_RELAXED);
+        if (age < ARP_REACHABLE_MS)
+            return ARP_LOOKUP_REACHABLE;
+        /* Obsoleta: sigue valiendo, pero solo un llamante por intervalo pide refresco */
+        uint32_t probed = __atomic_load_n(&e->probed, __ATOMIC_RELAXED);
+        if (now - probed >= ARP_PROBE_INTERVAL_MS &&
+            __atomic_compare_exchange_n(&e->probed, &probed, now, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return ARP_LOOKUP_STALE;
+        return ARP_LOOKUP_REACHABLE;
     }
-    return -1;  /* No encontrado */
+    return ARP_LOOKUP_MISS;
 }
 
-void arp_cache_update(const uint8_t *ip, const uint8_t *mac)
+/* Vecino conocido con la misma MAC: basta con confirmarlo, sin arp_write_lock.
+   0 si no esta o cambio de MAC */
+static int arp_confirm(uint32_t key, const uint8_t *mac, uint32_t now, uint32_t granularity)
+{
+    uint32_t base = arp_hash(key);
+    for (unsigned int i = 0; i < ARP_PROBE_WINDOW; i++) {
+        arp_entry_t *e = arp_slot(base, i);
+        uint8_t cur[6];
+        uint32_t confirmed, seq;
+        while (arp_read(e, key, cur, &confirmed, &seq)) {
+            if (memcmp(cur, mac, 6) != 0)
+                return 0;
+            if (now - confirmed < granularity)
+                return 1;
+            /* Solo si nadie la ha reescrito desde la lectura: si no, el hueco
+               puede ser ya de otro vecino. Se vuelve a leer y a comparar */
+            if (arp_seq_begin(e, &seq)) {
+                __atomic_store_n(&e->confirmed, now, __ATOMIC_RELAXED);
+                arp_seq_end(e);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void arp_refresh(const uint8_t *ip, const uint8_t *mac)
 {
-    memcpy(cache_ip, ip, 4);
-    memcpy(cache_mac, mac, 6);
-    cache_valid = 1;
-    printf("ARP: cached %d.%d.%d.%d -> %02x:%02x:%02x:%02x:%02x:%02x\n",
+    uint32_t key;
+    memcpy(&key, ip, 4);
+    if (key)
+        arp_confirm(key, mac, arp_now_ms(), ARP_USED_GRANULARITY_MS);
+}
+
+/* create 0: solo actualiza un vecino que ya estaba */
+static void arp_table_write(const uint8_t *ip, const uint8_t *mac, int create)
+{
+    uint32_t key;
+    memcpy(&key, ip, 4);
+    if (!key)
+        return;  /* Sondas de quien aun no tiene direccion */
+
+    uint32_t now = arp_now_ms();
+    uint32_t base = arp_hash(key);
+    if (arp_confirm(key, mac, now, 0))
+        return;
+
+    pthread_mutex_lock(&arp_write_lock);
+    arp_entry_t *match = NULL, *free_slot = NULL, *victim = NULL;
+    uint32_t victim_used = 0;
+    for (unsigned int i = 0; i < ARP_PROBE_WINDOW; i++) {
+        arp_entry_t *e = arp_slot(base, i);
+        if (e->ip == key) {
+            match = e;
+            break;
+        }
+        if (!free_slot && (!e->ip ||
+            now - __atomic_load_n(&e->confirmed, __ATOMIC_RELAXED) >= ARP_STALE_MS))
+            free_slot = e;
+        uint32_t used = __atomic_load_n(&e->used, __ATOMIC_RELAXED);
+        if (!victim || (int32_t)(used - victim_used) < 0) {
+            victim = e;
+            victim_used = used;
+        }
+    }
+    if (!match && !create) {
+        pthread_mutex_unlock(&arp_write_lock);
+        return;
+    }
+    arp_entry_t *slot = match ? match : free_slot;
+    if (!slot) {
+        slot = victim;
+        arp_evictions++;
+    }
+    arp_write(slot, key, mac, now);
+    pthread_mutex_unlock(&arp_write_lock);
+
+    NIC_LOG_DEBUG(NIC_LOG_ARP, "cached %d.%d.%d.%d -> %02x:%02x:%02x:%02x:%02x:%02x",
            ip[0], ip[1], ip[2], ip[3],
            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 }
 
+void arp_cache_update(const uint8_t *ip, const uint8_t *mac)
+{
+    arp_table_write(ip, mac, 1);
+}
+
+void arp_get_table_stats(arp_table_stats_t *stats)
+{
+    uint32_t now = arp_now_ms();
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = ARP_TABLE_SIZE;
+    for (unsigned int i = 0; i < ARP_TABLE_SIZE; i++) {
+        if (!__atomic_load_n(&arp_table[i].ip, __ATOMIC_RELAXED))
+            continue;
+        uint32_t age = now - __atomic_load_n(&arp_table[i].confirmed, __ATOMIC_RELAXED);
+        if (age < ARP_REACHABLE_MS)
+            stats->reachable++;
+        else if (age < ARP_STALE_MS)
+            stats->stale++;
+    }
+    pthread_mutex_lock(&arp_write_lock);
+    stats->evictions = arp_evictions;
+    pthread_mutex_unlock(&arp_write_lock);
+}
+
+static int arp_send_request_vlan(device_handle *dev, nic_driver_t *drv,
+                                 uint16_t vlan_id, uint16_t outer_vlan_id,
+                                 const uint8_t *sender_ip, const uint8_t *target_ip,
+                                 const uint8_t *dst_mac)
+{
+    static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    /* Un barrido de destinos desconocidos no debe convertirse en otra tormenta */
+    if (!arp_bucket_take(&arp_tx_bucket, ARP_TX_RATE, ARP_TX_BURST, arp_now_ms())) {
+        NIC_STATS_ADD((nic_device_t *)dev->owner, tx_arp_suppressed, 1);
+        return -1;
+    }
+    nic_packet_t *pkt = eth_alloc_packet(drv, dev);
+    uint8_t *arp_buf = pkt ? nic_packet_append(pkt, sizeof(arp_packet)) : NULL;
+    if (!arp_buf) {
+        nic_packet_release(pkt);
+        return -1;
+    }
+    pkt->vlan_id = vlan_id;
+    pkt->outer_vlan_id = outer_vlan_id;
+    arp_build_request(arp_buf, dev, sender_ip, target_ip);
+    return ethernet_send(drv, dev, pkt, dst_mac ? dst_mac : broadcast, ethtype_ARP);
+}
+
+int arp_send_request(device_handle *dev, nic_driver_t *drv, const nic_packet_t *orig,
+                     const uint8_t *sender_ip, const uint8_t *target_ip,
+                     const uint8_t *dst_mac)
+{
+    /* Preguntar en la misma VLAN por la que saldria el paquete */
+    return arp_send_request_vlan(dev, drv, orig->vlan_id, orig->outer_vlan_id,
+                                 sender_ip, target_ip, dst_mac);
+}
+
+int arp_send_gratuitous(device_handle *dev, nic_driver_t *drv, const uint8_t *ip)
+{
+    static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    nic_packet_t *pkt = eth_alloc_packet(drv, dev);
+    uint8_t *arp_buf = pkt ? nic_packet_append(pkt, sizeof(arp_packet)) : NULL;
+    if (!arp_buf) {
+        nic_packet_release(pkt);
+        return -1;
+    }
+    arp_build_request(arp_buf, dev, ip, ip);
+    NIC_LOG_INFO(NIC_LOG_ARP, "gratuitous ARP for %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+    return ethernet_send(drv, dev, pkt, broadcast, ethtype_ARP);
+}
+
+/* Descarta una cadena de paquetes retenidos, fuera de arp_pending_lock */
+static void arp_drop_chain(nic_packet_t *pkt, device_handle *dev)
+{
+    unsigned long dropped = 0;
+    while (pkt) {
+        nic_packet_t *next = pkt->next;
+        nic_packet_release(pkt);
+        pkt = next;
+        dropped++;
+    }
+    if (dropped)
+        NIC_STATS_ADD((nic_device_t *)dev->owner, tx_dropped_unresolved, dropped);
+}
+
+int arp_hold_packet(device_handle *dev, nic_driver_t *drv, const uint8_t *ip,
+                    const uint8_t *sender_ip, nic_packet_t *pkt)
+{
+    uint32_t key;
+    memcpy(&key, ip, 4);
+    uint32_t now = arp_now_ms();
+    nic_packet_t *dropped = NULL;
+    int send_request = 0;
+
+    pthread_mutex_lock(&arp_pending_lock);
+    /* La respuesta pudo llegar entre la busqueda del llamador y el cerrojo, y
+       arp_handle vacia la cola despues de escribir la tabla: mirar otra vez */
+    uint8_t mac[6];
+    if (arp_lookup(ip, mac) >= 0) {
+        pthread_mutex_unlock(&arp_pending_lock);
+        return ethernet_send(drv, dev, pkt, mac, ethtype_IPv4);
+    }
+
+    arp_pending_t *entry = NULL, *free_entry = NULL;
+    for (unsigned int i = 0; i < ARP_PENDING_NEIGHBORS; i++) {
+        if (arp_pending[i].ip == key) {
+            entry = &arp_pending[i];
+            break;
+        }
+        if (!free_entry && !arp_pending[i].ip)
+            free_entry = &arp_pending[i];
+    }
+    if (!entry) {
+        if (!free_entry) {
+            pthread_mutex_unlock(&arp_pending_lock);
+            pkt->next = NULL;
+            arp_drop_chain(pkt, dev);
+            return -1;
+        }
+        entry = free_entry;
+        entry->ip = key;
+        memcpy(entry->sender_ip, sender_ip, 4);
+        entry->vlan_id = pkt->vlan_id;
+        entry->outer_vlan_id = pkt->outer_vlan_id;
+        entry->dev = dev;
+        entry->drv = drv;
+        entry->head = entry->tail = NULL;
+        entry->count = 0;
+        entry->requests = 1;
+        entry->last_request = now;
+        __atomic_store_n(&arp_pending_count, arp_pending_count + 1, __ATOMIC_RELAXED);
+        send_request = 1;
+    }
+    if (entry->count == ARP_PENDING_PACKETS) {
+        /* Lo mas reciente vale mas (p.ej. la retransmision de un SYN) */
+        dropped = entry->head;
+        entry->head = dropped->next;
+        dropped->next = NULL;
+        entry->count--;
+    }
+    pkt->next = NULL;
+    if (entry->head)
+        entry->tail->next = pkt;
+    else
+        entry->head = pkt;
+    entry->tail = pkt;
+    entry->count++;
+    /* pkt ya es de la cola: otro hilo puede enviarlo en cuanto se suelte el cerrojo */
+    uint16_t vlan_id = entry->vlan_id, outer_vlan_id = entry->outer_vlan_id;
+    pthread_mutex_unlock(&arp_pending_lock);
+
+    /* La peticion se construye y se envia fuera del cerrojo, como arp_flush_pending */
+    if (send_request)
+        arp_send_request_vlan(dev, drv, vlan_id, outer_vlan_id, sender_ip, ip, NULL);
+    arp_drop_chain(dropped, dev);
+    return 0;
+}
+
+/* Hay paquetes esperando a ip, es decir, le hemos preguntado nosotros */
+static int arp_is_pending(const uint8_t *ip)
+{
+    if (!__atomic_load_n(&arp_pending_count, __ATOMIC_RELAXED))
+        return 0;
+
+    uint32_t key;
+    memcpy(&key, ip, 4);
+    int found = 0;
+    pthread_mutex_lock(&arp_pending_lock);
+    for (unsigned int i = 0; i < ARP_PENDING_NEIGHBORS && !found; i++)
+        found = arp_pending[i].ip == key;
+    pthread_mutex_unlock(&arp_pending_lock);
+    return found;
+}
+
+/* El vecino contesto: enviar lo que esperaba por el, en orden */
+static void arp_flush_pending(const uint8_t *ip, const uint8_t *mac)
+{
+    if (!__atomic_load_n(&arp_pending_count, __ATOMIC_RELAXED))
+        return;
+
+    uint32_t key;
+    memcpy(&key, ip, 4);
+    nic_packet_t *pkt = NULL;
+    device_handle *dev = NULL;
+    nic_driver_t *drv = NULL;
+    pthread_mutex_lock(&arp_pending_lock);
+    for (unsigned int i = 0; i < ARP_PENDING_NEIGHBORS; i++) {
+        if (arp_pending[i].ip == key) {
+            pkt = arp_pending[i].head;
+            dev = arp_pending[i].dev;
+            drv = arp_pending[i].drv;
+            arp_pending[i].ip = 0;
+            __atomic_store_n(&arp_pending_count, arp_pending_count - 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&arp_pending_lock);
+
+    while (pkt) {
+        nic_packet_t *next = pkt->next;
+        pkt->next = NULL;
+        ethernet_send(drv, dev, pkt, mac, ethtype_IPv4);
+        pkt = next;
+    }
+}
+
+int arp_pending_tick(void)
+{
+    if (!__atomic_load_n(&arp_pending_count, __ATOMIC_RELAXED))
+        return -1;
+    /* Un worker basta, el resto sigue con su rafaga */
+    if (pthread_mutex_trylock(&arp_pending_lock) != 0)
+        return ARP_RETRANSMIT_MS;
+
+    /* Bajo el cerrojo solo se decide; peticiones y descartes van despues */
+    arp_pending_t due[ARP_PENDING_NEIGHBORS];
+    unsigned int due_count = 0;
+    int next = -1;
+    uint32_t now = arp_now_ms();
+    for (unsigned int i = 0; i < ARP_PENDING_NEIGHBORS; i++) {
+        arp_pending_t *entry = &arp_pending[i];
+        if (!entry->ip)
+            continue;
+        uint32_t elapsed = now - entry->last_request;
+        if (elapsed < ARP_RETRANSMIT_MS) {
+            if (next < 0 || (int)(ARP_RETRANSMIT_MS - elapsed) < next)
+                next = ARP_RETRANSMIT_MS - elapsed;
+            continue;
+        }
+        due[due_count] = *entry;
+        if (entry->requests >= ARP_MAX_REQUESTS) {
+            entry->ip = 0;
+            __atomic_store_n(&arp_pending_count, arp_pending_count - 1, __ATOMIC_RELAXED);
+        } else {
+            entry->requests++;
+            entry->last_request = now;
+            due[due_count].head = NULL;  /* La cola se queda esperando */
+            next = next < 0 || next > ARP_RETRANSMIT_MS ? ARP_RETRANSMIT_MS : next;
+        }
+        due_count++;
+    }
+    pthread_mutex_unlock(&arp_pending_lock);
+
+    for (unsigned int i = 0; i < due_count; i++) {
+        arp_pending_t *entry = &due[i];
+        uint8_t *ip = (uint8_t *)&entry->ip;
+        if (entry->head) {
+            NIC_LOG_DEBUG(NIC_LOG_ARP, "%d.%d.%d.%d unresolved, dropping %u packets",
+                   ip[0], ip[1], ip[2], ip[3], entry->count);
+            arp_drop_chain(entry->head, entry->dev);
+        } else {
+            arp_send_request_vlan(entry->dev, entry->drv, entry->vlan_id, entry->outer_vlan_id,
+                                  entry->sender_ip, ip, NULL);
+        }
+    }
+    return next;
+}
+
 static int ip_equals(const uint8_t *a, const uint8_t *b) {
     return memcmp(a, b, 4) == 0;
 }
 
-void arp_handle(const void *data, unsigned int length,
-                const uint8_t *src_mac, device_handle *dev,
-                nic_driver_t *drv)
+void arp_handle(nic_packet_t *pkt, const uint8_t *src_mac,
+                device_handle *dev, nic_driver_t *drv)
 {
-    if (length < sizeof(arp_packet)) {
-        printf("ARP: packet too short (%u bytes)\n", length);
+    nic_device_t *nic = (nic_device_t *)dev->owner;
+    if (pkt->len < sizeof(arp_packet)) {
+        NIC_LOG_DEBUG(NIC_LOG_ARP, "packet too short (%u bytes)", pkt->len);
+        NIC_STATS_ADD(nic, rx_dropped_short, 1);
         return;
     }
     
-    const arp_packet *arp = (const arp_packet *)data;
+    /* Primero el cubo de quien envia, para que un solo host no agote el global.
+       Si el global no deja pasar la trama, la ficha del emisor se devuelve: un
+       host que se porta bien no debe quedar frenado por una tormenta ajena */
+    uint32_t now = arp_now_ms();
+    uint32_t mac_tail;
+    memcpy(&mac_tail, src_mac + 2, 4);
+    uint64_t *source = &arp_source_buckets[arp_hash(mac_tail) & (ARP_SOURCE_BUCKETS - 1)];
+    if (!arp_bucket_take(source, ARP_SOURCE_RATE, ARP_SOURCE_BURST, now)) {
+        NIC_STATS_ADD(nic, rx_dropped_arp_storm, 1);
+        return;
+    }
+    if (!arp_bucket_take(&arp_rx_bucket, ARP_RX_RATE, ARP_RX_BURST, now)) {
+        arp_bucket_refund(source, ARP_SOURCE_BURST);
+        NIC_STATS_ADD(nic, rx_dropped_arp_storm, 1);
+        return;
+    }
+    
+    const arp_packet *arp = (const arp_packet *)nic_packet_data(pkt);
     uint16_t opcode = ntohs(arp->opcode);
     
-    printf("ARP: opcode=%s sender=%d.%d.%d.%d target=%d.%d.%d.%d\n",
+    NIC_LOG_DEBUG(NIC_LOG_ARP, "opcode=%s sender=%d.%d.%d.%d target=%d.%d.%d.%d",
            opcode == ARP_REQUEST ? "REQUEST" : "REPLY",
            arp->sender_ip[0], arp->sender_ip[1],
            arp->sender_ip[2], arp->sender_ip[3],
            arp->target_ip[0], arp->target_ip[1],
            arp->target_ip[2], arp->target_ip[3]);
     
-    /* Actualizar caché con quien habla */
-    arp_cache_update(arp->sender_ip, (uint8_t *)src_mac);
+    /* Solo se aprende de quien nos pregunta o responde a una pregunta nuestra;
+       del resto (peticiones entre terceros, ARP gratuito) se actualiza lo que ya
+       estaba, asi un barrido no llena la tabla (RFC 826) */
+    const uint8_t *my_ip = eth_local_ip(dev, pkt->vlan_id);
+    int for_me = my_ip && ip_equals(arp->target_ip, my_ip);
+    int learn = for_me || arp_is_pending(arp->sender_ip);
+    arp_table_write(arp->sender_ip, src_mac, learn);
+    if (learn)
+        arp_flush_pending(arp->sender_ip, src_mac);
     
-    /* Si es REQUEST para nosotros, responder */
-    if (opcode == ARP_REQUEST && ip_equals(arp->target_ip, dev->ip)) {
-        printf("ARP: REQUEST for me, sending REPLY...\n");
+    /* Si es REQUEST para nosotros (en la VLAN de la trama), responder */
+    if (opcode == ARP_REQUEST && for_me) {
+        NIC_LOG_DEBUG(NIC_LOG_ARP, "REQUEST for me, sending REPLY...");
         
-        ethernet_frame frame = {0};
-        
-        unsigned int arp_len = arp_build_reply(frame.payload, dev,
-                                               arp->sender_mac, arp->sender_ip);
-        
-        memcpy(frame.dest_mac, src_mac, 6);
-        memcpy(frame.src_mac, dev->mac, 6);
-        frame.ethertype = htons(ethtype_ARP);
+        nic_packet_t *reply = eth_alloc_packet(drv, dev);
+        uint8_t *payload = reply ? nic_packet_append(reply, sizeof(arp_packet)) : NULL;
+        if (!payload) {
+            NIC_LOG_WARN(NIC_LOG_ARP, "no buffer for REPLY");
+            nic_packet_release(reply);
+            return;
+        }
         
-        unsigned int total_len = ETH_HEADER_LEN + arp_len;
+        arp_build_reply(payload, dev, my_ip, arp->sender_mac, arp->sender_ip);
         
-        if (ethernet_send(drv, (nic_device_t *)dev, &frame, total_len) == STATUS_OK) {
-            printf("ARP: REPLY sent\n");
+        if (ethernet_send(drv, dev, reply, src_mac, ethtype_ARP) == STATUS_OK) {
+            NIC_LOG_DEBUG(NIC_LOG_ARP, "REPLY sent");
         } else {
-            printf("ARP: failed to send REPLY\n");
+            NIC_LOG_WARN(NIC_LOG_ARP, "failed to send REPLY");
         }
     }
 }
 
 unsigned int arp_build_request(void *buffer, device_handle *dev,
+                               const uint8_t *sender_ip,
                                const uint8_t *target_ip)
 {
     arp_packet *arp = (arp_packet *)buffer;
@@ -89,7 +617,7 @@ unsigned int arp_build_request(void *buffer, device_handle *dev,
     arp->opcode = htons(ARP_REQUEST);
     
     memcpy(arp->sender_mac, dev->mac, 6);
-    memcpy(arp->sender_ip, dev->ip, 4);
+    memcpy(arp->sender_ip, sender_ip, 4);
     memset(arp->target_mac, 0, 6);
     memcpy(arp->target_ip, target_ip, 4);
     
@@ -97,6 +625,7 @@ unsigned int arp_build_request(void *buffer, device_handle *dev,
 }
 
 unsigned int arp_build_reply(void *buffer, device_handle *dev,
+                             const uint8_t *sender_ip,
                              const uint8_t *target_mac,
                              const uint8_t *target_ip)
 {
@@ -109,7 +638,7 @@ unsigned int arp_build_reply(void *buffer, device_handle *dev,
     arp->opcode = htons(ARP_REPLY);
     
     memcpy(arp->sender_mac, dev->mac, 6);
-    memcpy(arp->sender_ip, dev->ip, 4);
+    memcpy(arp->sender_ip, sender_ip, 4);
     memcpy(arp->target_mac, target_mac, 6);
     memcpy(arp->target_ip, target_ip, 4);
     
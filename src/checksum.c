@@ -0,0 +1,143 @@
+#include "checksum.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#endif
+
+/* Por debajo de esto no compensa la llamada indirecta ni preparar registros */
+#define CSUM_VECTOR_MIN 64
+
+typedef uint64_t (*csum_kernel_t)(const void *data, size_t len, uint64_t sum);
+
+/* Palabras de 32 bits sobre un acumulador de 64: plegar al final da lo mismo
+   que sumar de 16 en 16, con la mitad de sumas y sin acarreos intermedios */
+static uint64_t csum_scalar(const void *data, size_t len, uint64_t sum)
+{
+    const uint8_t *p = data;
+    uint32_t w0, w1, w2, w3;
+    while (len >= 16) {
+        memcpy(&w0, p, 4);
+        memcpy(&w1, p + 4, 4);
+        memcpy(&w2, p + 8, 4);
+        memcpy(&w3, p + 12, 4);
+        sum += (uint64_t)w0 + w1 + w2 + w3;
+        p += 16;
+        len -= 16;
+    }
+    while (len >= 4) {
+        memcpy(&w0, p, 4);
+        sum += w0;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t h;
+        memcpy(&h, p, 2);
+        sum += h;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        /* Byte impar: parte alta en orden de red, es decir el primero en memoria */
+        uint16_t h = 0;
+        memcpy(&h, p, 1);
+        sum += h;
+    }
+    return sum;
+}
+
+#ifdef CSUM_X86
+/* Cada carril de 64 bits acumula palabras de 32: no desborda antes de 2^32 vueltas */
+static uint64_t csum_sse2(const void *data, size_t len, uint64_t sum)
+{
+    const uint8_t *p = data;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    while (len >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+        p += 32;
+        len -= 32;
+    }
+    acc0 = _mm_add_epi64(acc0, acc1);
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc0);
+    /* Cada carril puede rozar 2^63: plegarlos antes de juntarlos */
+    sum += (lanes[0] & 0xFFFFFFFF) + (lanes[0] >> 32) + (lanes[1] & 0xFFFFFFFF) + (lanes[1] >> 32);
+    return csum_scalar(p, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2(const void *data, size_t len, uint64_t sum)
+{
+    const uint8_t *p = data;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    while (len >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+        p += 64;
+        len -= 64;
+    }
+    acc0 = _mm256_add_epi64(acc0, acc1);
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc0);
+    for (int i = 0; i < 4; i++)
+        sum += (lanes[i] & 0xFFFFFFFF) + (lanes[i] >> 32);
+    return csum_scalar(p, len, sum);
+}
+#endif
+
+static uint64_t csum_dispatch(const void *data, size_t len, uint64_t sum);
+
+static csum_kernel_t csum_kernel = csum_dispatch;
+static const char *csum_name = "scalar";
+
+/* Primera llamada: elegir nucleo segun la CPU y quedarse con el */
+static uint64_t csum_dispatch(const void *data, size_t len, uint64_t sum)
+{
+    csum_kernel_t kernel = csum_scalar;
+    const char *name = "scalar";
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = csum_avx2;
+        name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = csum_sse2;
+        name = "sse2";
+    }
+#endif
+    __atomic_store_n(&csum_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&csum_kernel, kernel, __ATOMIC_RELAXED);
+    return kernel(data, len, sum);
+}
+
+uint64_t csum_partial(const void *data, size_t len, uint64_t sum)
+{
+    if (len < CSUM_VECTOR_MIN)
+        return csum_scalar(data, len, sum);
+    return __atomic_load_n(&csum_kernel, __ATOMIC_RELAXED)(data, len, sum);
+}
+
+const char * csum_kernel_name(void)
+{
+    if (__atomic_load_n(&csum_kernel, __ATOMIC_RELAXED) == csum_dispatch) {
+        uint8_t probe[CSUM_VECTOR_MIN] = {0};
+        csum_dispatch(probe, sizeof(probe), 0);
+    }
+    return __atomic_load_n(&csum_name, __ATOMIC_RELAXED);
+}
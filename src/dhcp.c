@@ -1,4 +1,7 @@
 #include "dhcp.h"
+#include "ethernet.h"
+#include "arp.h"
+#include "log.h"
 #include <string.h>
 #include <stdio.h>
 #include <arpa/inet.h>
@@ -51,10 +54,19 @@ static void dhcp_send(struct device_handle *dev,
                       uint32_t req_ip,
                       uint32_t server_id)
 {
-    uint8_t buffer[1500];
-    memset(buffer, 0, sizeof(buffer));
+    nic_driver_t *drv = nic_get_driver();
+    nic_packet_t *pkt = eth_alloc_packet(drv, dev);
+    if (!pkt)
+        return;
+
+    // Construir cabecera UDP + DHCP directamente en el paquete
+    uint8_t *buffer = nic_packet_append(pkt, sizeof(udp_hdr_t) + sizeof(dhcp_msg_t));
+    if (!buffer) {
+        nic_packet_release(pkt);
+        return;
+    }
+    memset(buffer, 0, sizeof(udp_hdr_t) + sizeof(dhcp_msg_t));
 
-    // Construir cabecera UDP + DHCP dentro de buffer
     udp_hdr_t *uh = (udp_hdr_t *)buffer;
     dhcp_msg_t *dh = (dhcp_msg_t *)(buffer + sizeof(udp_hdr_t));
 
@@ -104,16 +116,14 @@ static void dhcp_send(struct device_handle *dev,
     uh->len      = htons(sizeof(udp_hdr_t) + dhcp_len);
     uh->checksum = 0; // para el laboratorio, lo dejamos a 0
 
-    int udp_total_len = sizeof(udp_hdr_t) + dhcp_len;
-
     // Enviar como IPv4/UDP a broadcast 255.255.255.255
     uint32_t dst_ip = 0xFFFFFFFF; // broadcast
-    ipv4_send(dev, dst_ip, 17 /* UDP */, buffer, udp_total_len);
+    ipv4_send(dev, drv, dst_ip, 17 /* UDP */, pkt);
 }
 
 void dhcp_start(struct device_handle *dev)
 {
-    printf("[DHCP] Enviando DHCPDISCOVER...\n");
+    NIC_LOG_INFO(NIC_LOG_DHCP, "Enviando DHCPDISCOVER...");
     dhcp_lease.valid = 0;
     dhcp_send(dev, DHCPDISCOVER, 0, 0);
 }
@@ -152,7 +162,7 @@ void dhcp_handle_udp(uint8_t *segment, int len, struct device_handle *dev)
 
     if (msg_type == DHCPOFFER) {
         uint32_t offered_ip = ntohl(dh->yiaddr);
-        printf("[DHCP] DHCPOFFER recibido. IP ofrecida: %u.%u.%u.%u\n",
+        NIC_LOG_INFO(NIC_LOG_DHCP, "DHCPOFFER recibido. IP ofrecida: %u.%u.%u.%u",
                (offered_ip >> 24) & 0xFF,
                (offered_ip >> 16) & 0xFF,
                (offered_ip >> 8)  & 0xFF,
@@ -166,7 +176,7 @@ void dhcp_handle_udp(uint8_t *segment, int len, struct device_handle *dev)
         dhcp_lease.server_id = server_id;
 
         // Enviar DHCPREQUEST
-        printf("[DHCP] Enviando DHCPREQUEST...\n");
+        NIC_LOG_INFO(NIC_LOG_DHCP, "Enviando DHCPREQUEST...");
         dhcp_send(dev, DHCPREQUEST, offered_ip, server_id);
     }
     else if (msg_type == DHCPACK) {
@@ -188,12 +198,18 @@ void dhcp_handle_udp(uint8_t *segment, int len, struct device_handle *dev)
         dhcp_lease.valid = 1;
 
         // Escribir IP en dev->ip[4]
+        uint8_t old_ip[4];
+        memcpy(old_ip, dev->ip, 4);
         dev->ip[0] = (assigned_ip >> 24) & 0xFF;
         dev->ip[1] = (assigned_ip >> 16) & 0xFF;
         dev->ip[2] = (assigned_ip >> 8)  & 0xFF;
         dev->ip[3] = assigned_ip & 0xFF;
 
-        printf("[DHCP] DHCPACK recibido. IP asignada: %u.%u.%u.%u\n",
+        NIC_LOG_INFO(NIC_LOG_DHCP, "DHCPACK recibido. IP asignada: %u.%u.%u.%u",
                dev->ip[0], dev->ip[1], dev->ip[2], dev->ip[3]);
+
+        // Direccion nueva: anunciarla para que nadie siga usando la MAC vieja en sus caches
+        if (memcmp(old_ip, dev->ip, 4) != 0)
+            arp_send_gratuitous(dev, nic_get_driver(), dev->ip);
     }
 }
\ No newline at end of file
@@ -1,11 +1,289 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
 #include <arpa/inet.h>
 
 #include "ethernet.h"
 #include "arp.h"
 #include "ipv4.h"
+#include "log.h"
+
+/* Manejadores del stack, registrados de serie */
+static void eth_arp_handler(nic_packet_t *pkt, device_handle *dev, nic_driver_t *drv)
+{
+    NIC_STATS_ADD((nic_device_t *)dev->owner, rx_proto[NIC_PROTO_ARP], 1);
+    arp_handle(pkt, eth_src_mac(pkt), dev, drv);
+}
+
+static void eth_ipv4_handler(nic_packet_t *pkt, device_handle *dev, nic_driver_t *drv)
+{
+    NIC_STATS_ADD((nic_device_t *)dev->owner, rx_proto[NIC_PROTO_IPV4], 1);
+    ipv4_handler(pkt, dev, drv);
+}
+
+typedef struct eth_handler_entry {
+    uint16_t type;
+    uint16_t free;          /* Desregistrada, reutilizable tras un periodo de gracia */
+    eth_handler_t handler;
+    eth_batch_handler_t batch_handler;
+    eth_type_stats_t stats;
+} __attribute__((aligned(64))) eth_handler_entry;
+
+/*
+ * Tabla directa ethertype -> entrada: un byte por ethertype (64 KiB) y una
+ * sola lectura por trama. La entrada 0 significa "sin manejador". Una entrada
+ * desregistrada solo pasa a otro ethertype despues de un periodo de gracia,
+ * asi un hilo que aun la use nunca ve el manejador de otro protocolo.
+ */
+static eth_handler_entry eth_handlers[ETH_MAX_HANDLERS] = {
+    [1] = { .type = ethtype_ARP, .handler = eth_arp_handler },
+    [2] = { .type = ethtype_IPv4, .handler = eth_ipv4_handler },
+};
+static unsigned int eth_handler_count = 3;
+static uint8_t eth_handler_index[65536] = {
+    [ethtype_ARP] = 1,
+    [ethtype_IPv4] = 2,
+};
+static pthread_mutex_t eth_handler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Periodo de gracia, como el de los workers en interface.c: cada hilo que usa
+ * la tabla tiene una epoca, impar mientras despacha tramas. Los huecos de
+ * eth_readers se toman la primera vez y se liberan al terminar el hilo. Si no
+ * queda ninguno, el hilo cuenta en eth_readers_untracked.
+ */
+typedef struct eth_reader {
+    unsigned long epoch;
+    int used;
+} __attribute__((aligned(64))) eth_reader_t;
+
+static eth_reader_t eth_readers[ETH_MAX_READERS];
+static unsigned long eth_readers_untracked;
+static __thread eth_reader_t *eth_reader;
+static __thread unsigned int eth_reader_depth;  /* Los manejadores envian, y se anida */
+static __thread int eth_reader_claimed;
+static pthread_key_t eth_reader_key;
+static pthread_once_t eth_reader_once = PTHREAD_ONCE_INIT;
+
+static void eth_reader_release(void *reader)
+{
+    __atomic_store_n(&((eth_reader_t *)reader)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void eth_reader_key_init(void)
+{
+    pthread_key_create(&eth_reader_key, eth_reader_release);
+}
+
+static void eth_reader_claim(void)
+{
+    eth_reader_claimed = 1;
+    pthread_once(&eth_reader_once, eth_reader_key_init);
+    for (unsigned int i = 0; i < ETH_MAX_READERS; i++) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&eth_readers[i].used, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            eth_reader = &eth_readers[i];
+            pthread_setspecific(eth_reader_key, eth_reader);
+            return;
+        }
+    }
+}
+
+static inline void eth_read_enter(void)
+{
+    if (eth_reader_depth++)
+        return;
+    if (__builtin_expect(!eth_reader_claimed, 0))
+        eth_reader_claim();
+    if (eth_reader)
+        __atomic_fetch_add(&eth_reader->epoch, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&eth_readers_untracked, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void eth_read_exit(void)
+{
+    if (--eth_reader_depth)
+        return;
+    if (eth_reader)
+        __atomic_fetch_add(&eth_reader->epoch, 1, __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_sub(&eth_readers_untracked, 1, __ATOMIC_RELEASE);
+}
+
+/* Espera a que todo hilo que pudiera tener una entrada vieja salga de su
+   despacho. Desde dentro de un manejador no se puede esperar a uno mismo: 0 */
+static int eth_synchronize(void)
+{
+    if (eth_reader_depth)
+        return 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (unsigned int i = 0; i < ETH_MAX_READERS; i++) {
+        eth_reader_t *reader = &eth_readers[i];
+        unsigned long epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+        while ((epoch & 1) && __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE) == epoch)
+            sched_yield();
+    }
+    while (__atomic_load_n(&eth_readers_untracked, __ATOMIC_ACQUIRE))
+        sched_yield();
+    return 1;
+}
+
+/* Entrada de type, tambien si se desregistro y aun no se ha reutilizado */
+static unsigned int eth_find_slot(uint16_t type)
+{
+    for (unsigned int i = 1; i < eth_handler_count; i++) {
+        if (eth_handlers[i].type == type)
+            return i;
+    }
+    return 0;
+}
+
+/* Una entrada libre de otro ethertype, ya sin nadie que la use. Antes de
+   crecer la tabla; desde un manejador no hay espera posible y se crece */
+static unsigned int eth_reuse_slot(void)
+{
+    for (unsigned int i = 1; i < eth_handler_count; i++) {
+        if (!eth_handlers[i].free)
+            continue;
+        if (!eth_synchronize())
+            return 0;
+        eth_type_stats_t *stats = &eth_handlers[i].stats;
+        __atomic_store_n(&stats->rx_packets, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->rx_bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->tx_packets, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->tx_bytes, 0, __ATOMIC_RELAXED);
+        return i;
+    }
+    return 0;
+}
+
+int eth_register_handler(uint16_t type, eth_handler_t handler, eth_batch_handler_t batch_handler)
+{
+    if (!handler && !batch_handler)
+        return -1;
+
+    pthread_mutex_lock(&eth_handler_lock);
+    unsigned int slot = eth_find_slot(type);
+    if (!slot) {
+        slot = eth_reuse_slot();
+        if (!slot && eth_handler_count < ETH_MAX_HANDLERS)
+            slot = eth_handler_count++;
+        if (!slot) {
+            pthread_mutex_unlock(&eth_handler_lock);
+            return -1;  /* Tabla llena */
+        }
+        eth_handlers[slot].type = type;
+    }
+    eth_handlers[slot].free = 0;
+    __atomic_store_n(&eth_handlers[slot].handler, handler, __ATOMIC_RELAXED);
+    __atomic_store_n(&eth_handlers[slot].batch_handler, batch_handler, __ATOMIC_RELAXED);
+    /* Publicar la entrada ya completa */
+    __atomic_store_n(&eth_handler_index[type], (uint8_t)slot, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&eth_handler_lock);
+    return 0;
+}
+
+int eth_unregister_handler(uint16_t type)
+{
+    pthread_mutex_lock(&eth_handler_lock);
+    unsigned int slot = eth_handler_index[type];
+    if (slot) {
+        /* Las tramas ya clasificadas pueden llegar aun: veran la entrada vacia */
+        __atomic_store_n(&eth_handler_index[type], 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&eth_handlers[slot].handler, NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&eth_handlers[slot].batch_handler, NULL, __ATOMIC_RELAXED);
+        eth_handlers[slot].free = 1;
+    }
+    pthread_mutex_unlock(&eth_handler_lock);
+    return slot ? 0 : -1;
+}
+
+int eth_get_type_stats(uint16_t type, eth_type_stats_t *stats)
+{
+    if (!stats)
+        return -1;
+    eth_read_enter();
+    unsigned int slot = __atomic_load_n(&eth_handler_index[type], __ATOMIC_ACQUIRE);
+    if (slot) {
+        eth_type_stats_t *counters = &eth_handlers[slot].stats;
+        stats->rx_packets = __atomic_load_n(&counters->rx_packets, __ATOMIC_RELAXED);
+        stats->rx_bytes = __atomic_load_n(&counters->rx_bytes, __ATOMIC_RELAXED);
+        stats->tx_packets = __atomic_load_n(&counters->tx_packets, __ATOMIC_RELAXED);
+        stats->tx_bytes = __atomic_load_n(&counters->tx_bytes, __ATOMIC_RELAXED);
+    }
+    eth_read_exit();
+    return slot ? 0 : -1;
+}
+
+/* Direcciones por VLAN, solo se escriben al configurar */
+static uint8_t eth_vlan_ips[ETH_MAX_VLANS][4];
+static uint8_t eth_vlan_bound[ETH_MAX_VLANS];
+
+/* VLAN de la trama que el hilo esta procesando, la heredan las respuestas */
+static __thread uint16_t eth_rx_vlan;
+static __thread uint16_t eth_rx_outer_vlan;
+
+int eth_vlan_bind(uint16_t vid, const uint8_t *ip)
+{
+    if (vid == 0 || vid >= ETH_MAX_VLANS || !ip)
+        return -1;
+    memcpy(eth_vlan_ips[vid], ip, 4);
+    __atomic_store_n(&eth_vlan_bound[vid], 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int eth_vlan_unbind(uint16_t vid)
+{
+    if (vid == 0 || vid >= ETH_MAX_VLANS)
+        return -1;
+    __atomic_store_n(&eth_vlan_bound[vid], 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+const uint8_t * eth_local_ip(device_handle *dev, uint16_t vid)
+{
+    if (vid == 0)
+        return dev->ip;
+    if (vid >= ETH_MAX_VLANS || !__atomic_load_n(&eth_vlan_bound[vid], __ATOMIC_ACQUIRE))
+        return NULL;
+    return eth_vlan_ips[vid];
+}
+
+/* Escribe TPID y TCI, el ethertype siguiente va detras */
+static inline uint8_t * eth_put_tag(uint8_t *at, uint16_t tpid, uint16_t vid)
+{
+    uint16_t tag[2] = { htons(tpid), htons(vid & ETH_VLAN_VID_MASK) };
+    memcpy(at, tag, sizeof(tag));
+    return at + ETH_VLAN_TAG_LEN;
+}
+
+/*
+ * Etiqueta una trama ya construida: solo se mueven las dos MAC hacia el
+ * headroom, el payload no se copia. La etiqueta queda como la mas externa.
+ */
+int eth_vlan_insert(nic_packet_t *pkt, uint16_t tpid, uint16_t vid)
+{
+    if (pkt->len < ETH_HEADER_LEN)
+        return -1;
+    uint8_t *frame = nic_packet_prepend(pkt, ETH_VLAN_TAG_LEN);
+    if (!frame)
+        return -1;
+    memmove(frame, frame + ETH_VLAN_TAG_LEN, ETH_MAC_LEN * 2);
+    eth_put_tag(frame + ETH_MAC_LEN * 2, tpid, vid);
+    return 0;
+}
+
+static inline void eth_count(unsigned long *packets, unsigned long *bytes,
+                             unsigned long n, unsigned long length)
+{
+    __atomic_fetch_add(packets, n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(bytes, length, __ATOMIC_RELAXED);
+}
 
 unsigned int eth_build_frame(ethernet_frame *frame, const uint8_t *src_mac,
                              const uint8_t *dst_mac, const uint16_t type,
@@ -19,10 +297,55 @@ unsigned int eth_build_frame(ethernet_frame *frame, const uint8_t *src_mac,
     return ETH_HEADER_LEN + payload_len;
 }
 
-int ethernet_send(nic_driver_t *drv, nic_device_t *nic,
-                  ethernet_frame *frame, unsigned int length)
+nic_packet_t * eth_alloc_packet(nic_driver_t *drv, device_handle *dev)
+{
+    /* Deja headroom para que cada capa anteponga su cabecera */
+    nic_packet_t *pkt = drv->alloc_packet((nic_device_t *)dev->owner);
+    if (pkt) {
+        /* Una respuesta sale por la VLAN por la que llego la peticion */
+        pkt->vlan_id = eth_rx_vlan;
+        pkt->outer_vlan_id = eth_rx_outer_vlan;
+    }
+    return pkt;
+}
+
+int ethernet_send(nic_driver_t *drv, device_handle *dev, nic_packet_t *pkt,
+                  const uint8_t *dst_mac, const uint16_t type)
 {
-    return drv->send_packet(nic, frame, length);
+    /* Cabecera y etiquetas se escriben en el headroom, sin mover el payload */
+    unsigned int header_len = ETH_HEADER_LEN;
+    if (pkt->vlan_id)
+        header_len += ETH_VLAN_TAG_LEN;
+    if (pkt->outer_vlan_id)
+        header_len += ETH_VLAN_TAG_LEN;
+    ethernet_frame *frame = (ethernet_frame *)nic_packet_prepend(pkt, header_len);
+    if (!frame) {
+        nic_packet_release(pkt);
+        return STATUS_ERROR;
+    }
+    memcpy(frame->dest_mac, dst_mac, 6);
+    memcpy(frame->src_mac, dev->mac, 6);
+    uint8_t *next = (uint8_t *)&frame->ethertype;
+    if (pkt->outer_vlan_id)
+        next = eth_put_tag(next, ethtype_QINQ, pkt->outer_vlan_id);
+    if (pkt->vlan_id)
+        next = eth_put_tag(next, ethtype_VLAN, pkt->vlan_id);
+    uint16_t ethertype = htons(type);
+    memcpy(next, &ethertype, sizeof(ethertype));
+
+    if (type == ethtype_ARP)
+        NIC_STATS_ADD((nic_device_t *)dev->owner, tx_proto[NIC_PROTO_ARP], 1);
+    else if (type == ethtype_IPv4)
+        NIC_STATS_ADD((nic_device_t *)dev->owner, tx_proto[NIC_PROTO_IPV4], 1);
+    eth_read_enter();
+    unsigned int slot = __atomic_load_n(&eth_handler_index[type], __ATOMIC_ACQUIRE);
+    if (slot)
+        eth_count(&eth_handlers[slot].stats.tx_packets, &eth_handlers[slot].stats.tx_bytes,
+                  1, pkt->len - header_len);
+    eth_read_exit();
+
+    /* El driver se queda con el paquete, sin copias */
+    return drv->send_pkt((nic_device_t *)dev->owner, pkt);
 }
 
 static inline int eth_is_for_me(const ethernet_frame *frame, const uint8_t *my_mac) {
@@ -31,40 +354,165 @@ static inline int eth_is_for_me(const ethernet_frame *frame, const uint8_t *my_m
            (memcmp(frame->dest_mac, broadcast, 6) == 0);
 }
 
-void ethernet_handle(const void *data, unsigned int length,
-                     device_handle *dev, nic_driver_t *drv)
+/* Valida la trama y quita la cabecera, devuelve la entrada o 0 si se descarta */
+static unsigned int eth_classify(nic_packet_t *pkt, device_handle *dev)
 {
-    if (length < ETH_HEADER_LEN) {
-        printf("Ethernet: frame too short (%u bytes)\n", length);
-        return;
+    nic_device_t *nic = (nic_device_t *)dev->owner;
+
+    if (pkt->len < ETH_HEADER_LEN) {
+        NIC_LOG_DEBUG(NIC_LOG_ETH, "frame too short (%u bytes)", pkt->len);
+        NIC_STATS_ADD(nic, rx_dropped_short, 1);
+        return 0;
     }
     
-    const ethernet_frame *frame = (const ethernet_frame *)data;
+    const ethernet_frame *frame = (const ethernet_frame *)nic_packet_data(pkt);
     uint16_t ethertype = ntohs(frame->ethertype);
-    unsigned int payload_len = length - ETH_HEADER_LEN;
     
     if (!eth_is_for_me(frame, dev->mac)) {
-        printf("Ethernet: not for me\n");
-        return;
+        NIC_LOG_DEBUG(NIC_LOG_ETH, "not for me");
+        NIC_STATS_ADD(nic, rx_dropped_not_for_me, 1);
+        return 0;
     }
     
-    printf("Ethernet: src=%02x:%02x:%02x:%02x:%02x:%02x type=0x%04x\n",
+    /* 802.1Q y QinQ: leer hasta dos etiquetas, la interna da la VLAN */
+    unsigned int header_len = ETH_HEADER_LEN;
+    pkt->vlan_id = pkt->outer_vlan_id = 0;
+    for (int tags = 0; tags < 2 && (ethertype == ethtype_VLAN || ethertype == ethtype_QINQ); tags++) {
+        if (pkt->len < header_len + ETH_VLAN_TAG_LEN) {
+            NIC_STATS_ADD(nic, rx_dropped_short, 1);
+            return 0;
+        }
+        eth_vlan_tag tag;
+        memcpy(&tag, nic_packet_data(pkt) + header_len, sizeof(tag));
+        pkt->outer_vlan_id = pkt->vlan_id;
+        pkt->vlan_id = ntohs(tag.tci) & ETH_VLAN_VID_MASK;
+        ethertype = ntohs(tag.ethertype);
+        header_len += ETH_VLAN_TAG_LEN;
+    }
+
+    NIC_LOG_DEBUG(NIC_LOG_ETH, "src=%02x:%02x:%02x:%02x:%02x:%02x type=0x%04x vlan=%u",
            frame->src_mac[0], frame->src_mac[1], frame->src_mac[2],
            frame->src_mac[3], frame->src_mac[4], frame->src_mac[5],
-           ethertype);
+           ethertype, pkt->vlan_id);
+
+    /* Solo se atienden las VLAN con direccion asignada */
+    if (pkt->vlan_id && !eth_local_ip(dev, pkt->vlan_id)) {
+        NIC_STATS_ADD(nic, rx_dropped_vlan, 1);
+        return 0;
+    }
+
+    /* Una sola lectura, sin recorrer la lista de protocolos */
+    unsigned int slot = __atomic_load_n(&eth_handler_index[ethertype], __ATOMIC_ACQUIRE);
+    if (!slot) {
+        NIC_LOG_DEBUG(NIC_LOG_ETH, "unknown ethertype 0x%04x", ethertype);
+        NIC_STATS_ADD(nic, rx_dropped_unknown_ethertype, 1);
+        return 0;
+    }
     
-    switch (ethertype) {
-        case ethtype_ARP:
-            arp_handle(frame->payload, payload_len, 
-                      (uint8_t *)frame->src_mac, dev, drv);
-            break;
-        case ethtype_IPv4:
-            /* Actualizar caché ARP con IP/MAC origen */
-            /* Necesitamos parsear el header IP para obtener la IP */
-            /* Por simplicidad, lo hacemos en ipv4_handler */
-            ipv4_handler((uint8_t *)frame->payload, payload_len, dev, drv);
-            break;
-        default:
-            printf("Ethernet: unknown ethertype 0x%04x\n", ethertype);
-    }
-}
\ No newline at end of file
+    /* Quitar cabecera y etiquetas, la capa 3 empieza en el payload */
+    pkt->l2_off = pkt->data_off;
+    nic_packet_pull(pkt, header_len);
+    pkt->l3_off = pkt->data_off;
+    return slot;
+}
+
+/* Entrega a un manejador con la VLAN de la trama como contexto del hilo */
+static inline void eth_dispatch(eth_handler_t handler, nic_packet_t *pkt,
+                                device_handle *dev, nic_driver_t *drv)
+{
+    eth_rx_vlan = pkt->vlan_id;
+    eth_rx_outer_vlan = pkt->outer_vlan_id;
+    handler(pkt, dev, drv);
+    eth_rx_vlan = eth_rx_outer_vlan = 0;
+}
+
+/* Igual para un lote; todas sus tramas son de la misma VLAN */
+static inline void eth_dispatch_batch(eth_batch_handler_t handler, nic_packet_t **pkts,
+                                      unsigned int count, device_handle *dev, nic_driver_t *drv)
+{
+    eth_rx_vlan = pkts[0]->vlan_id;
+    eth_rx_outer_vlan = pkts[0]->outer_vlan_id;
+    handler(pkts, count, dev, drv);
+    eth_rx_vlan = eth_rx_outer_vlan = 0;
+}
+
+static inline int eth_same_vlan(const nic_packet_t *a, const nic_packet_t *b)
+{
+    return a->vlan_id == b->vlan_id && a->outer_vlan_id == b->outer_vlan_id;
+}
+
+void ethernet_handle(nic_packet_t *pkt, device_handle *dev, nic_driver_t *drv)
+{
+    arp_pending_tick();
+    eth_read_enter();
+    unsigned int slot = eth_classify(pkt, dev);
+    if (slot) {
+        eth_handler_entry *entry = &eth_handlers[slot];
+        eth_count(&entry->stats.rx_packets, &entry->stats.rx_bytes, 1, pkt->len);
+        eth_handler_t handler = __atomic_load_n(&entry->handler, __ATOMIC_RELAXED);
+        eth_batch_handler_t batch_handler = __atomic_load_n(&entry->batch_handler, __ATOMIC_RELAXED);
+        /* Ninguno de los dos si se acaba de desregistrar */
+        if (handler)
+            eth_dispatch(handler, pkt, dev, drv);
+        else if (batch_handler)
+            eth_dispatch_batch(batch_handler, &pkt, 1, dev, drv);
+    }
+    eth_read_exit();
+}
+
+void ethernet_handle_batch(nic_packet_t *pkts, unsigned int count,
+                           device_handle *dev, nic_driver_t *drv)
+{
+    /* Agrupar por ethertype: una llamada por protocolo y ráfaga */
+    nic_packet_t *groups[ETH_MAX_HANDLERS][NIC_RX_BATCH_SIZE];
+    unsigned int group_count[ETH_MAX_HANDLERS] = {0};
+    unsigned long group_bytes[ETH_MAX_HANDLERS] = {0};
+    eth_batch_handler_t batch_handlers[ETH_MAX_HANDLERS];
+
+    arp_pending_tick();
+    eth_read_enter();
+    for (unsigned int base = 0; base < count; base += NIC_RX_BATCH_SIZE) {
+        unsigned int end = count - base < NIC_RX_BATCH_SIZE ? count : base + NIC_RX_BATCH_SIZE;
+        for (unsigned int i = base; i < end; i++) {
+            /* Traer la siguiente cabecera mientras esta sube por el stack */
+            if (i + 1 < end)
+                __builtin_prefetch(nic_packet_data(&pkts[i + 1]));
+            nic_packet_t *pkt = &pkts[i];
+            unsigned int slot = eth_classify(pkt, dev);
+            if (!slot)
+                continue;
+
+            eth_handler_entry *entry = &eth_handlers[slot];
+            eth_batch_handler_t batch_handler = __atomic_load_n(&entry->batch_handler, __ATOMIC_RELAXED);
+            if (!batch_handler) {
+                /* Sin manejador por lotes: se entrega en el momento, en orden */
+                eth_count(&entry->stats.rx_packets, &entry->stats.rx_bytes, 1, pkt->len);
+                eth_handler_t handler = __atomic_load_n(&entry->handler, __ATOMIC_RELAXED);
+                if (handler)
+                    eth_dispatch(handler, pkt, dev, drv);
+                continue;
+            }
+            /* Un lote lleva una sola VLAN de contexto: si cambia, entregar lo que habia */
+            if (group_count[slot] && !eth_same_vlan(groups[slot][0], pkt)) {
+                eth_count(&entry->stats.rx_packets, &entry->stats.rx_bytes, group_count[slot], group_bytes[slot]);
+                eth_dispatch_batch(batch_handlers[slot], groups[slot], group_count[slot], dev, drv);
+                group_count[slot] = 0;
+                group_bytes[slot] = 0;
+            }
+            if (!group_count[slot])
+                batch_handlers[slot] = batch_handler;
+            groups[slot][group_count[slot]++] = pkt;
+            group_bytes[slot] += pkt->len;
+        }
+        for (unsigned int slot = 1; slot < ETH_MAX_HANDLERS; slot++) {
+            if (!group_count[slot])
+                continue;
+            eth_handler_entry *entry = &eth_handlers[slot];
+            eth_count(&entry->stats.rx_packets, &entry->stats.rx_bytes, group_count[slot], group_bytes[slot]);
+            eth_dispatch_batch(batch_handlers[slot], groups[slot], group_count[slot], dev, drv);
+            group_count[slot] = 0;
+            group_bytes[slot] = 0;
+        }
+    }
+    eth_read_exit();
+}
@@ -1,8 +1,13 @@
+#define _GNU_SOURCE
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <linux/if_packet.h>
 #include <net/ethernet.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,6 +16,54 @@
 #include "hal.h"
 #include "commons.h"
 
+// Write the tag the kernel kept out of band (VLAN rx offload), frames then look as on the wire
+static void __hal_put_vlan_tag(unsigned char *tag, unsigned int status, unsigned short tpid, unsigned short tci) {
+    if (!(status & TP_STATUS_VLAN_TPID_VALID) || !tpid) {
+        tpid = ETH_P_8021Q;
+    }
+    tag[0] = tpid >> 8;
+    tag[1] = tpid & 0xFF;
+    tag[2] = tci >> 8;
+    tag[3] = tci & 0xFF;
+}
+
+static void __hal_setup_rx_ring(struct device_handle *handle) {
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+
+    handle->rx_ring = NULL;
+    handle->rx_block_index = 0;
+    if (setsockopt(handle->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        return;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = HAL_RX_BLOCK_SIZE;
+    req.tp_block_nr = HAL_RX_BLOCK_COUNT;
+    req.tp_frame_size = HAL_RX_FRAME_SIZE;
+    req.tp_frame_nr = (HAL_RX_BLOCK_SIZE / HAL_RX_FRAME_SIZE) * HAL_RX_BLOCK_COUNT;
+    req.tp_retire_blk_tov = HAL_RX_BLOCK_TIMEOUT_MS;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    if (setsockopt(handle->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        return;
+    }
+
+    void *ring = mmap(NULL, req.tp_block_size * req.tp_block_nr, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_LOCKED, handle->fd, 0);
+    if (ring == MAP_FAILED) {
+        // MAP_LOCKED may exceed RLIMIT_MEMLOCK, retry without it
+        ring = mmap(NULL, req.tp_block_size * req.tp_block_nr, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, handle->fd, 0);
+        if (ring == MAP_FAILED) {
+            return;
+        }
+    }
+    handle->rx_ring = ring;
+    handle->rx_ring_size = req.tp_block_size * req.tp_block_nr;
+    handle->rx_block_size = req.tp_block_size;
+    handle->rx_block_count = req.tp_block_nr;
+}
+
 void * hal_create_device() {
     struct device_handle *handle = malloc(sizeof(struct device_handle));
     if (!handle) {
@@ -41,7 +94,20 @@ void * hal_create_device() {
     sll.sll_ifindex = handle->index;
     sll.sll_protocol = htons(ETH_P_ALL);
 
+    // The NIC worker multiplexes the socket with epoll, never block on it
+    fcntl(handle->fd, F_SETFL, fcntl(handle->fd, F_GETFL) | O_NONBLOCK);
+    // Offloaded VLAN tags come with each read as auxdata (the ring always reports them)
+    int auxdata = 1;
+    setsockopt(handle->fd, SOL_PACKET, PACKET_AUXDATA, &auxdata, sizeof(auxdata));
+    handle->owner = NULL;
+
+    // The ring must be configured before bind so no frame bypasses it
+    __hal_setup_rx_ring(handle);
+
     if (bind(handle->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        if (handle->rx_ring) {
+            munmap(handle->rx_ring, handle->rx_ring_size);
+        }
         close(handle->fd);
         free(handle);
         return NULL;
@@ -52,6 +118,9 @@ void * hal_create_device() {
 void hal_remove_device(void *handle) {
     struct device_handle *dev_handle = (struct device_handle *)handle;
     if (dev_handle) {
+        if (dev_handle->rx_ring) {
+            munmap(dev_handle->rx_ring, dev_handle->rx_ring_size);
+        }
         close(dev_handle->fd);
         free(dev_handle);
     }
@@ -61,8 +130,74 @@ unsigned int hal_send(void * handle, void * data, unsigned int length) {
     return write(((struct device_handle *)handle)->fd, data, length);
 }
 
+unsigned int hal_send_batch(void *handle, hal_tx_frame_t *frames, unsigned int count) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    struct mmsghdr msgs[HAL_TX_BATCH_SIZE];
+    struct iovec iovs[HAL_TX_BATCH_SIZE];
+
+    if (count > HAL_TX_BATCH_SIZE) {
+        count = HAL_TX_BATCH_SIZE;
+    }
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for (unsigned int i = 0; i < count; i++) {
+        iovs[i].iov_base = frames[i].data;
+        iovs[i].iov_len = frames[i].length;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        frames[i].sent = 0;
+    }
+
+    // sendmmsg stops at the first failing frame. A full socket buffer (or a signal)
+    // ends the batch there, only a frame that fails on its own is skipped
+    unsigned int i = 0;
+    while (i < count) {
+        int ret = sendmmsg(dev_handle->fd, &msgs[i], count - i, 0);
+        if (ret <= 0) {
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR)) {
+                break;
+            }
+            i++;
+            continue;
+        }
+        for (int j = 0; j < ret; j++) {
+            frames[i + j].sent = msgs[i + j].msg_len;
+        }
+        i += ret;
+    }
+    return i;
+}
+
 unsigned int hal_receive(void * handle, void * buffer, unsigned int buffer_length) {
-    return read(((struct device_handle *)handle)->fd, buffer, buffer_length);
+    struct iovec iov = { .iov_base = buffer, .iov_len = buffer_length };
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    ssize_t received = recvmsg(((struct device_handle *)handle)->fd, &msg, 0);
+    if (received <= 0) {
+        return 0;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_PACKET || cmsg->cmsg_type != PACKET_AUXDATA) {
+            continue;
+        }
+        struct tpacket_auxdata aux;
+        memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+        unsigned char *frame = (unsigned char *)buffer;
+        if ((aux.tp_status & TP_STATUS_VLAN_VALID) && received >= 2 * ETH_ALEN &&
+            (size_t)received + HAL_VLAN_TAG_LEN <= buffer_length) {
+            memmove(frame + 2 * ETH_ALEN + HAL_VLAN_TAG_LEN, frame + 2 * ETH_ALEN, received - 2 * ETH_ALEN);
+            __hal_put_vlan_tag(frame + 2 * ETH_ALEN, aux.tp_status, aux.tp_vlan_tpid, aux.tp_vlan_tci);
+            received += HAL_VLAN_TAG_LEN;
+        }
+    }
+    return (unsigned int)received;
 }
 
 void hal_get_mac_address(void * handle, unsigned char *mac) {
@@ -78,4 +213,105 @@ unsigned int hal_get_mtu(void * handle) {
         return dev_handle->mtu;
     }
     return 0;
+}
+
+// Changes the interface MTU (needs CAP_NET_ADMIN), every socket on it sees the new value
+int hal_set_mtu(void * handle, unsigned int mtu) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    if (!dev_handle) {
+        return -1;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    memcpy(ifr.ifr_name, dev_handle->name, IFNAMSIZ-1);
+    ifr.ifr_mtu = mtu;
+    if (ioctl(dev_handle->fd, SIOCSIFMTU, &ifr) < 0) {
+        return -1;
+    }
+    dev_handle->mtu = mtu;
+    return 0;
+}
+
+int hal_rx_ring_enabled(void *handle) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    return dev_handle && dev_handle->rx_ring != NULL;
+}
+
+int hal_get_fd(void *handle) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    if (dev_handle) {
+        return dev_handle->fd;
+    }
+    return -1;
+}
+
+int hal_join_fanout(void *handle, unsigned short group_id) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    int fanout_arg = group_id | (HAL_FANOUT_MODE << 16);
+    return setsockopt(dev_handle->fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg));
+}
+
+int hal_set_busy_poll(void *handle, unsigned int usecs) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    // Socket polls spin on the device queue for up to usecs, 0 turns it off.
+    // Values above net.core.busy_read need CAP_NET_ADMIN.
+    int value = (int)usecs;
+    return setsockopt(dev_handle->fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+}
+
+int hal_set_qdisc_bypass(void *handle, int enable) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    // Hand tx frames straight to the driver, skipping the qdisc layer
+    int value = enable ? 1 : 0;
+    return setsockopt(dev_handle->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &value, sizeof(value));
+}
+
+int hal_rx_block_acquire(void *handle, hal_rx_block_t *block) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    struct tpacket_block_desc *desc = (struct tpacket_block_desc *)
+        ((unsigned char *)dev_handle->rx_ring + dev_handle->rx_block_index * dev_handle->rx_block_size);
+
+    // The kernel hands the block over by setting TP_STATUS_USER
+    if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+        return 0;
+    }
+    block->block = desc;
+    block->num_frames = desc->hdr.bh1.num_pkts;
+    block->frame_index = 0;
+    block->next_frame = (unsigned char *)desc + desc->hdr.bh1.offset_to_first_pkt;
+    return 1;
+}
+
+int hal_rx_block_next_frame(hal_rx_block_t *block, void **data, unsigned int *length,
+                            unsigned long long *tstamp) {
+    if (block->frame_index >= block->num_frames) {
+        return 0;
+    }
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)block->next_frame;
+    *data = (unsigned char *)hdr + hdr->tp_mac;
+    *length = hdr->tp_snaplen;
+    // Reinsert an offloaded tag in place, the gap after the sockaddr_ll has room for it
+    if ((hdr->tp_status & TP_STATUS_VLAN_VALID) && *length >= 2 * ETH_ALEN &&
+        hdr->tp_mac >= TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) + sizeof(struct sockaddr_ll) + HAL_VLAN_TAG_LEN) {
+        unsigned char *frame = (unsigned char *)*data - HAL_VLAN_TAG_LEN;
+        memmove(frame, *data, 2 * ETH_ALEN);
+        __hal_put_vlan_tag(frame + 2 * ETH_ALEN, hdr->tp_status, hdr->hv1.tp_vlan_tpid, hdr->hv1.tp_vlan_tci);
+        *data = frame;
+        *length += HAL_VLAN_TAG_LEN;
+    }
+    // Kernel receive time, taken when the frame was written into the ring
+    *tstamp = (unsigned long long)hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+    block->frame_index++;
+    block->next_frame = (unsigned char *)hdr + hdr->tp_next_offset;
+    return 1;
+}
+
+void hal_rx_block_release(void *handle, hal_rx_block_t *block) {
+    struct device_handle *dev_handle = (struct device_handle *)handle;
+    struct tpacket_block_desc *desc = (struct tpacket_block_desc *)block->block;
+
+    // Give the block back to the kernel and move on to the next one
+    __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    dev_handle->rx_block_index = (dev_handle->rx_block_index + 1) % dev_handle->rx_block_count;
+    block->block = NULL;
 }
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include "http.h"
 #include "tcp.h"
+#include "ipv4.h"
+#include "ethernet.h"
+#include "log.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -52,7 +55,7 @@ static void trim(char *str) {
 void http_init(http_request_handler_t handler, void *user_data) {
     g_request_handler = handler;
     g_user_data = user_data;
-    printf("HTTP: Server initialized\n");
+    NIC_LOG_INFO(NIC_LOG_HTTP, "Server initialized");
 }
 
 bool http_parse_request(const uint8_t *data, size_t len, http_request_t *request) {
@@ -68,14 +71,14 @@ bool http_parse_request(const uint8_t *data, size_t len, http_request_t *request
     
     line_end = find_line_end(start, end);
     if (!line_end) {
-        printf("HTTP: No valid request line found\n");
+        NIC_LOG_DEBUG(NIC_LOG_HTTP, "No valid request line found");
         return false;
     }
     
     char request_line[512];
     size_t line_len = line_end - start;
     if (line_len >= sizeof(request_line)) {
-        printf("HTTP: Request line too long\n");
+        NIC_LOG_DEBUG(NIC_LOG_HTTP, "Request line too long");
         return false;
     }
     
@@ -88,7 +91,7 @@ bool http_parse_request(const uint8_t *data, size_t len, http_request_t *request
     
     int parsed = sscanf(request_line, "%15s %255s %15s", method_str, path, version);
     if (parsed != 3) {
-        printf("HTTP: Failed to parse request line: %s\n", request_line);
+        NIC_LOG_DEBUG(NIC_LOG_HTTP, "Failed to parse request line: %s", request_line);
         return false;
     }
     
@@ -96,7 +99,7 @@ bool http_parse_request(const uint8_t *data, size_t len, http_request_t *request
     strncpy(request->path, path, HTTP_MAX_PATH_SIZE - 1);
     strncpy(request->version, version, sizeof(request->version) - 1);
     
-    printf("HTTP: %s %s %s\n", method_str, request->path, request->version);
+    NIC_LOG_DEBUG(NIC_LOG_HTTP, "%s %s %s", method_str, request->path, request->version);
 
     start = line_end + 2;
     request->header_count = 0;
@@ -191,28 +194,39 @@ void http_response_set_body(http_response_t *response, const char *body, size_t
     response->body_len = body_len;
 }
 
-int http_serialize_response(const http_response_t *response, uint8_t *buffer, size_t buffer_size) {
-    if (!response || !buffer || buffer_size == 0) {
-        return -1;
-    }
-    
-    int offset = 0;
+/* Status line y cabeceras, el body se copia aparte */
+static int http_serialize_head(const http_response_t *response, uint8_t *buffer, size_t buffer_size) {
+    size_t offset = 0;
+    int written;
 
-    offset += snprintf((char *)buffer + offset, buffer_size - offset,
+    written = snprintf((char *)buffer + offset, buffer_size - offset,
                       "HTTP/1.1 %d %s\r\n",
                       response->status_code, response->status_text);
-    
-    if (offset >= buffer_size) return -1;
+    offset += written;
+    if (written < 0 || offset >= buffer_size) return -1;
     
     for (int i = 0; i < response->header_count; i++) {
-        offset += snprintf((char *)buffer + offset, buffer_size - offset,
+        written = snprintf((char *)buffer + offset, buffer_size - offset,
                           "%s: %s\r\n",
                           response->headers[i].name, response->headers[i].value);
-        if (offset >= buffer_size) return -1;
+        offset += written;
+        if (written < 0 || offset >= buffer_size) return -1;
     }
     
-    offset += snprintf((char *)buffer + offset, buffer_size - offset, "\r\n");
-    if (offset >= buffer_size) return -1;
+    written = snprintf((char *)buffer + offset, buffer_size - offset, "\r\n");
+    offset += written;
+    if (written < 0 || offset >= buffer_size) return -1;
+
+    return offset;
+}
+
+int http_serialize_response(const http_response_t *response, uint8_t *buffer, size_t buffer_size) {
+    if (!response || !buffer || buffer_size == 0) {
+        return -1;
+    }
+    
+    int offset = http_serialize_head(response, buffer, buffer_size);
+    if (offset < 0) return -1;
 
     if (response->body && response->body_len > 0) {
         if (offset + response->body_len > buffer_size) {
@@ -225,35 +239,76 @@ int http_serialize_response(const http_response_t *response, uint8_t *buffer, si
     return offset;
 }
 
-int http_send_response(struct device_handle *dev, tcp_conn_t *conn, 
+/* Envía un segmento ya montado en pkt y avanza la secuencia si sale */
+static int http_send_segment(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn,
+                             nic_packet_t *pkt, uint8_t flags) {
+    uint16_t len = pkt->len;
+    int result = tcp_send(dev, drv, conn->remote_ip, conn->local_port, conn->remote_port,
+                          conn->seq, conn->ack, flags, pkt);
+    if (result == 0) {
+        conn->seq += len;
+    }
+    return result;
+}
+
+int http_send_response(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn, 
                        const http_response_t *response) {
-    if (!dev || !conn || !response) {
+    if (!dev || !drv || !conn || !response) {
         return -1;
     }
     
-    uint8_t buffer[HTTP_MAX_RESPONSE_SIZE];
-    int len = http_serialize_response(response, buffer, sizeof(buffer));
-    
-    if (len < 0) {
-        printf("HTTP: Failed to serialize response\n");
+    /* Serializar directamente en los paquetes de TX, troceando por el MSS
+       acordado (la MTU puede haber bajado desde el SYN) */
+    unsigned int mss = tcp_local_mss(dev);
+    if (conn->mss && conn->mss < mss) {
+        mss = conn->mss;
+    }
+    nic_packet_t *pkt = eth_alloc_packet(drv, dev);
+    if (!pkt) {
+        NIC_LOG_WARN(NIC_LOG_HTTP, "No buffer for response");
         return -1;
     }
-    
-    printf("HTTP: Sending %d bytes response (status %d)\n", len, response->status_code);
-    
-    int result = tcp_send(dev, conn->remote_ip, conn->local_port, conn->remote_port,
-                         conn->seq, conn->ack, 
-                         TCP_FLAG_PSH | TCP_FLAG_ACK, 
-                         buffer, len);
-    
-    if (result == 0) {
-        conn->seq += len;
+    unsigned int room = nic_packet_tailroom(pkt) < mss ? nic_packet_tailroom(pkt) : mss;
+    int head_len = http_serialize_head(response, nic_packet_data(pkt), room);
+    if (head_len < 0) {
+        NIC_LOG_WARN(NIC_LOG_HTTP, "Failed to serialize response");
+        nic_packet_release(pkt);
+        return -1;
+    }
+    nic_packet_append(pkt, head_len);
+    
+    NIC_LOG_INFO(NIC_LOG_HTTP, "Sending %zu bytes response (status %d)",
+           head_len + response->body_len, response->status_code);
+    
+    const char *body = response->body ? response->body : "";
+    size_t body_left = response->body ? response->body_len : 0;
+    for (;;) {
+        size_t chunk = room - pkt->len;
+        if (chunk > body_left) chunk = body_left;
+        if (chunk > 0) {
+            memcpy(nic_packet_append(pkt, chunk), body, chunk);
+            body += chunk;
+            body_left -= chunk;
+        }
+        
+        uint8_t flags = body_left ? TCP_FLAG_ACK : (TCP_FLAG_PSH | TCP_FLAG_ACK);
+        if (http_send_segment(dev, drv, conn, pkt, flags) != 0) {
+            return -1;
+        }
+        if (body_left == 0) {
+            return 0;
+        }
+        
+        pkt = eth_alloc_packet(drv, dev);
+        if (!pkt) {
+            NIC_LOG_WARN(NIC_LOG_HTTP, "No buffer for response");
+            return -1;
+        }
+        room = nic_packet_tailroom(pkt) < mss ? nic_packet_tailroom(pkt) : mss;
     }
-    
-    return result;
 }
 
-void http_send_text(struct device_handle *dev, tcp_conn_t *conn,
+void http_send_text(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn,
                     int status_code, const char *status_text, const char *body) {
     http_response_t response;
     http_response_init(&response, status_code, status_text);
@@ -269,10 +324,10 @@ void http_send_text(struct device_handle *dev, tcp_conn_t *conn,
     }
     
     http_response_add_header(&response, "Connection", "close");
-    http_send_response(dev, conn, &response);
+    http_send_response(dev, drv, conn, &response);
 }
 
-void http_send_html(struct device_handle *dev, tcp_conn_t *conn,
+void http_send_html(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn,
                     int status_code, const char *status_text, const char *html) {
     http_response_t response;
     http_response_init(&response, status_code, status_text);
@@ -288,10 +343,10 @@ void http_send_html(struct device_handle *dev, tcp_conn_t *conn,
     }
     
     http_response_add_header(&response, "Connection", "close");
-    http_send_response(dev, conn, &response);
+    http_send_response(dev, drv, conn, &response);
 }
 
-void http_send_404(struct device_handle *dev, tcp_conn_t *conn) {
+void http_send_404(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn) {
     const char *html = 
         "<!DOCTYPE html>\n"
         "<html>\n"
@@ -302,10 +357,10 @@ void http_send_404(struct device_handle *dev, tcp_conn_t *conn) {
         "</body>\n"
         "</html>\n";
     
-    http_send_html(dev, conn, 404, "Not Found", html);
+    http_send_html(dev, drv, conn, 404, "Not Found", html);
 }
 
-void http_send_500(struct device_handle *dev, tcp_conn_t *conn) {
+void http_send_500(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn) {
     const char *html = 
         "<!DOCTYPE html>\n"
         "<html>\n"
@@ -316,21 +371,25 @@ void http_send_500(struct device_handle *dev, tcp_conn_t *conn) {
         "</body>\n"
         "</html>\n";
     
-    http_send_html(dev, conn, 500, "Internal Server Error", html);
+    http_send_html(dev, drv, conn, 500, "Internal Server Error", html);
 }
 
-void http_handler(struct device_handle *dev, tcp_conn_t *conn,
-                  const uint8_t *payload, int payload_len) {
-    if (!dev || !conn || !payload || payload_len <= 0) {
+void http_handler(struct device_handle *dev, nic_driver_t *drv, tcp_conn_t *conn,
+                  nic_packet_t *pkt) {
+    if (!dev || !drv || !conn || !pkt || pkt->len == 0) {
         return;
     }
     
-    printf("HTTP: Processing request (%d bytes)\n", payload_len);
+    /* La petición se parsea en el propio buffer de recepción */
+    const uint8_t *payload = nic_packet_data(pkt);
+    int payload_len = pkt->len;
+    
+    NIC_LOG_DEBUG(NIC_LOG_HTTP, "Processing request (%d bytes)", payload_len);
     
     http_request_t request;
     if (!http_parse_request(payload, payload_len, &request)) {
-        printf("HTTP: Failed to parse request\n");
-        http_send_500(dev, conn);
+        NIC_LOG_DEBUG(NIC_LOG_HTTP, "Failed to parse request");
+        http_send_500(dev, drv, conn);
         return;
     }
     
@@ -339,9 +398,9 @@ void http_handler(struct device_handle *dev, tcp_conn_t *conn,
         http_response_init(&response, 200, "OK");
         
         g_request_handler(&request, &response, g_user_data);
-        http_send_response(dev, conn, &response);
+        http_send_response(dev, drv, conn, &response);
     } else {
-        printf("HTTP: No handler registered, sending default response\n");
+        NIC_LOG_DEBUG(NIC_LOG_HTTP, "No handler registered, sending default response");
         
         const char *html = 
             "<!DOCTYPE html>\n"
@@ -364,6 +423,6 @@ void http_handler(struct device_handle *dev, tcp_conn_t *conn,
                 request.path, 
                 request.version);
         
-        http_send_html(dev, conn, 200, "OK", body);
+        http_send_html(dev, drv, conn, 200, "OK", body);
     }
 }
\ No newline at end of file
@@ -1,44 +1,60 @@
 #include "icmp.h"
 #include "ipv4.h"
+#include "ethernet.h"
+#include "checksum.h"
+#include "log.h"
 #include <string.h>
 #include <stdio.h>
 #include <arpa/inet.h>
 
-static uint16_t checksum(void *data, int len)
+/* La respuesta es la peticion con otro tipo: se copia entera y el checksum
+   se ajusta con RFC 1624 en vez de recorrer el payload otra vez */
+static int icmp_reply_echo(device_handle *dev, nic_driver_t *drv, uint32_t dst_ip,
+                           const icmp_hdr_t *request, unsigned int len)
 {
-    uint16_t *buf = data;
-    uint32_t sum = 0;
-    while(len > 1) { sum += *buf++; len -= 2; }
-    if(len) sum += *(uint8_t*)buf;
-    while(sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
-    return ~sum;
+    nic_packet_t *pkt = eth_alloc_packet(drv, dev);
+    uint8_t *buffer = pkt ? nic_packet_append(pkt, len) : NULL;
+    if(!buffer) {
+        nic_packet_release(pkt);
+        return -1;
+    }
+    memcpy(buffer, request, len);
+    icmp_hdr_t *icmp = (icmp_hdr_t *)buffer;
+    icmp->type = ICMP_TYPE_ECHO_REPLY;
+    icmp->checksum = csum_update16(request->checksum,
+                                   htons(ICMP_TYPE_ECHO_REQUEST << 8 | request->code),
+                                   htons(ICMP_TYPE_ECHO_REPLY << 8 | request->code));
+    return ipv4_send(dev, drv, dst_ip, IPV4_PROTO_ICMP, pkt);
 }
 
-void icmp_handler(uint8_t *packet, int len, device_handle *dev,
+void icmp_handler(nic_packet_t *pkt, device_handle *dev,
                   nic_driver_t *drv, uint32_t src_ip)
 {
+    uint8_t *packet = nic_packet_data(pkt);
+    unsigned int len = pkt->len;
+
     if(len < sizeof(icmp_hdr_t)) {
-        printf("ICMP: packet too short\n");
+        NIC_LOG_DEBUG(NIC_LOG_ICMP, "packet too short");
+        NIC_STATS_ADD((nic_device_t *)dev->owner, rx_dropped_short, 1);
         return;
     }
     
     icmp_hdr_t *icmp = (icmp_hdr_t *)packet;
+    if(!csum_verify(packet, len)) {
+        NIC_STATS_ADD((nic_device_t *)dev->owner, rx_dropped_bad_checksum, 1);
+        return;
+    }
     
-    printf("ICMP: type=%d code=%d from %d.%d.%d.%d\n",
+    NIC_LOG_DEBUG(NIC_LOG_ICMP, "type=%d code=%d from %d.%d.%d.%d",
            icmp->type, icmp->code,
            (src_ip >> 24) & 0xFF, (src_ip >> 16) & 0xFF,
            (src_ip >> 8) & 0xFF, src_ip & 0xFF);
     
     /* Echo Request (ping) -> responder con Echo Reply */
     if(icmp->type == ICMP_TYPE_ECHO_REQUEST && icmp->code == 0) {
-        printf("ICMP: Echo Request received, sending Reply...\n");
+        NIC_LOG_DEBUG(NIC_LOG_ICMP, "Echo Request received, sending Reply...");
         
-        uint8_t *echo_data = packet + sizeof(icmp_hdr_t);
-        uint16_t echo_data_len = len - sizeof(icmp_hdr_t);
-        
-        icmp_send_echo_reply(dev, drv, src_ip, 
-                            ntohs(icmp->id), ntohs(icmp->seq),
-                            echo_data, echo_data_len);
+        icmp_reply_echo(dev, drv, src_ip, icmp, len);
     }
 }
 
@@ -46,7 +62,13 @@ int icmp_send_echo_reply(device_handle *dev, nic_driver_t *drv,
                          uint32_t dst_ip, uint16_t id, uint16_t seq,
                          uint8_t *data, uint16_t data_len)
 {
-    uint8_t buffer[2048];
+    /* Construir la respuesta directamente en un paquete del pool */
+    nic_packet_t *pkt = eth_alloc_packet(drv, dev);
+    uint8_t *buffer = pkt ? nic_packet_append(pkt, sizeof(icmp_hdr_t) + data_len) : NULL;
+    if(!buffer) {
+        nic_packet_release(pkt);
+        return -1;
+    }
     icmp_hdr_t *icmp = (icmp_hdr_t *)buffer;
     
     icmp->type = ICMP_TYPE_ECHO_REPLY;
@@ -57,8 +79,7 @@ int icmp_send_echo_reply(device_handle *dev, nic_driver_t *drv,
     
     memcpy(buffer + sizeof(icmp_hdr_t), data, data_len);
     
-    icmp->checksum = checksum(buffer, sizeof(icmp_hdr_t) + data_len);
+    icmp->checksum = csum(buffer, sizeof(icmp_hdr_t) + data_len);
     
-    return ipv4_send(dev, drv, dst_ip, IPV4_PROTO_ICMP,
-                     buffer, sizeof(icmp_hdr_t) + data_len);
+    return ipv4_send(dev, drv, dst_ip, IPV4_PROTO_ICMP, pkt);
 }
\ No newline at end of file
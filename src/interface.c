@@ -1,11 +1,123 @@
-
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "interface.h"
 #include "hal.h"
+#include "pool.h"
+
+#define __NIC_CACHE_LINE        64
+
+// Bounded MPMC ring of frame descriptors (Vyukov). Every slot carries a sequence
+// number telling producers and consumers whose turn it is, so enqueue and dequeue
+// are a single CAS on their own cache-line-padded cursor.
+typedef struct nic_ring_slot {
+    unsigned long sequence;
+    void *data;
+    unsigned int length;
+} __attribute__((aligned(__NIC_CACHE_LINE))) nic_ring_slot_t;
+
+typedef struct nic_ring {
+    unsigned long enqueue_pos __attribute__((aligned(__NIC_CACHE_LINE)));
+    unsigned long dequeue_pos __attribute__((aligned(__NIC_CACHE_LINE)));
+    unsigned long mask __attribute__((aligned(__NIC_CACHE_LINE)));
+    nic_ring_slot_t *slots;
+} nic_ring_t;
+
+static nic_ring_t * __nic_ring_create(unsigned int size) {
+    unsigned long capacity = 1;
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    nic_ring_t *ring = aligned_alloc(__NIC_CACHE_LINE, sizeof(nic_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+    ring->slots = aligned_alloc(__NIC_CACHE_LINE, capacity * sizeof(nic_ring_slot_t));
+    if (!ring->slots) {
+        free(ring);
+        return NULL;
+    }
+    for (unsigned long i = 0; i < capacity; i++) {
+        ring->slots[i].sequence = i;
+    }
+    ring->mask = capacity - 1;
+    ring->enqueue_pos = 0;
+    ring->dequeue_pos = 0;
+    return ring;
+}
+
+static void __nic_ring_destroy(nic_ring_t *ring) {
+    free(ring->slots);
+    free(ring);
+}
+
+static int __nic_ring_push(nic_ring_t *ring, void *data, unsigned int length) {
+    nic_ring_slot_t *slot;
+    unsigned long pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)(sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0; // Full
+        } else {
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->data = data;
+    slot->length = length;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static unsigned long __nic_ring_count(nic_ring_t *ring) {
+    unsigned long dequeue_pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    unsigned long enqueue_pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    // Both cursors move concurrently, clamp the snapshot to the ring
+    long count = (long)(enqueue_pos - dequeue_pos);
+    if (count < 0) {
+        return 0;
+    }
+    return (unsigned long)count > ring->mask + 1 ? ring->mask + 1 : (unsigned long)count;
+}
+
+static int __nic_ring_pop(nic_ring_t *ring, void **data, unsigned int *length) {
+    nic_ring_slot_t *slot;
+    unsigned long pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)(sequence - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0; // Empty
+        } else {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    *data = slot->data;
+    *length = slot->length;
+    __atomic_store_n(&slot->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
 
 typedef unsigned char flags_t;
 typedef enum {
@@ -25,133 +137,868 @@ typedef enum {
 #define __SET_RX_CB(flags)      ((flags) |= __RX_CB_FLAG)
 #define __SET_ERROR_CB(flags)   ((flags) |= __ERROR_CB_FLAG)
 
-status_t __nic_add_callback(nic_callback_t **callback_list, nic_event_callback_t callback) {
-    nic_callback_t *new_callback = (nic_callback_t *)malloc(sizeof(nic_callback_t));
-    if (!new_callback) {
+// Workers mark the span where they dispatch callbacks, sleeping in epoll is a quiescent state
+static inline void __nic_rcu_enter(nic_queue_t *queue) {
+    __atomic_fetch_add(&queue->rcu_epoch, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void __nic_rcu_exit(nic_queue_t *queue) {
+    __atomic_fetch_add(&queue->rcu_epoch, 1, __ATOMIC_RELEASE);
+}
+
+// Wait until every worker that may hold an old table has left its dispatch span.
+// A callback that edits the tables runs inside one, it cannot wait for itself.
+static int __nic_synchronize(nic_device_t *device) {
+    pthread_t self = pthread_self();
+    for (unsigned int i = 0; i < device->num_workers; i++) {
+        if (pthread_equal(device->queues[i].thread, self)) {
+            return 0;
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (unsigned int i = 0; i < device->num_workers; i++) {
+        nic_queue_t *queue = &device->queues[i];
+        unsigned long epoch = __atomic_load_n(&queue->rcu_epoch, __ATOMIC_ACQUIRE);
+        while ((epoch & 1) && __atomic_load_n(&queue->rcu_epoch, __ATOMIC_ACQUIRE) == epoch) {
+            sched_yield();
+        }
+    }
+    return 1;
+}
+
+static void __nic_free_retired_callbacks(nic_device_t *device) {
+    while (device->retired_callbacks) {
+        nic_callback_table_t *table = device->retired_callbacks;
+        device->retired_callbacks = table->retired_next;
+        free(table);
+    }
+}
+
+// Swap in the new table with one store, the old one is kept until a grace period
+// has passed (left for a later writer or shutdown when called from a callback)
+static void __nic_publish_callbacks(nic_device_t *device, nic_callback_table_t **table,
+                                    nic_callback_table_t *new_table) {
+    nic_callback_table_t *old_table = *table;
+    __atomic_store_n(table, new_table, __ATOMIC_RELEASE);
+    if (old_table) {
+        old_table->retired_next = device->retired_callbacks;
+        device->retired_callbacks = old_table;
+    }
+    if (device->retired_callbacks && __nic_synchronize(device)) {
+        __nic_free_retired_callbacks(device);
+    }
+}
+
+status_t __nic_add_callback(nic_device_t *device, nic_callback_table_t **table, nic_event_callback_t callback) {
+    pthread_mutex_lock(&device->callback_lock);
+    nic_callback_table_t *old_table = *table;
+    unsigned int count = old_table ? old_table->count : 0;
+    nic_callback_table_t *new_table = (nic_callback_table_t *)malloc(sizeof(nic_callback_table_t) +
+                                                                     (count + 1) * sizeof(nic_event_callback_t));
+    if (!new_table) {
+        pthread_mutex_unlock(&device->callback_lock);
         return STATUS_ERROR;
     }
-    new_callback->callback = callback;
-    new_callback->next = *callback_list;
-    *callback_list = new_callback;
+    // Newest callback first, like the lists this replaced
+    new_table->count = count + 1;
+    new_table->retired_next = NULL;
+    new_table->callbacks[0] = callback;
+    if (count) {
+        memcpy(&new_table->callbacks[1], old_table->callbacks, count * sizeof(nic_event_callback_t));
+    }
+    __nic_publish_callbacks(device, table, new_table);
+    pthread_mutex_unlock(&device->callback_lock);
     return STATUS_OK;
 }
 
-status_t __nic_remove_callback(nic_callback_t **callback_list, nic_event_callback_t callback) {
-    nic_callback_t *current = *callback_list;
-    nic_callback_t *previous = NULL;
-    while (current) {
-        if (current->callback == callback) {
-            if (previous) {
-                previous->next = current->next;
-            } else {
-                *callback_list = current->next;
-            }
-            free(current);
-            return STATUS_OK;
+status_t __nic_remove_callback(nic_device_t *device, nic_callback_table_t **table, nic_event_callback_t callback) {
+    pthread_mutex_lock(&device->callback_lock);
+    nic_callback_table_t *old_table = *table;
+    unsigned int count = old_table ? old_table->count : 0;
+    unsigned int index = 0;
+    while (index < count && old_table->callbacks[index] != callback) {
+        index++;
+    }
+    if (index == count) {
+        pthread_mutex_unlock(&device->callback_lock);
+        return STATUS_NOT_SUPPORTED; // Callback not found
+    }
+    nic_callback_table_t *new_table = NULL;
+    if (count > 1) {
+        new_table = (nic_callback_table_t *)malloc(sizeof(nic_callback_table_t) +
+                                                   (count - 1) * sizeof(nic_event_callback_t));
+        if (!new_table) {
+            pthread_mutex_unlock(&device->callback_lock);
+            return STATUS_ERROR;
         }
-        previous = current;
-        current = current->next;
+        new_table->count = count - 1;
+        new_table->retired_next = NULL;
+        memcpy(new_table->callbacks, old_table->callbacks, index * sizeof(nic_event_callback_t));
+        memcpy(&new_table->callbacks[index], &old_table->callbacks[index + 1],
+               (count - index - 1) * sizeof(nic_event_callback_t));
     }
-    return STATUS_NOT_SUPPORTED; // Callback not found
+    __nic_publish_callbacks(device, table, new_table);
+    pthread_mutex_unlock(&device->callback_lock);
+    return STATUS_OK;
 }
 
-void __nic_thread(void * args) {
-    nic_device_t *device = (nic_device_t *)args;
-    //Main NIC processing loop
-    //1) update the rx buffer reading from hardware and update stats
-    //2) send everything in the tx buffer to hardware and update stats
-    //3) trigger callbacks as needed
-    unsigned char working_buffer[device->mtu+NIC_EXTRA_SIZE];
-    unsigned int received_length = 0;
-    flags_t internal_flags = __TX_FLAGS_NONE;
-    while (device->is_up) {
-        __CLEAR_ALL_FLAGS(internal_flags);
-        //Step 1: Receive packets from hardware into working buffer
-        received_length = hal_receive(device->hw_handle, working_buffer, device->mtu+NIC_EXTRA_SIZE);
-        if (received_length > 0) {
-            //Update rx statistics
-            device->stats.rx_packets++;
-            //Copy received data into rx buffer
-            nic_buffer_t *new_rx_buffer = (nic_buffer_t *)malloc(sizeof(nic_buffer_t));
-            if (new_rx_buffer) {
-                new_rx_buffer->data = malloc(received_length);
-                if (new_rx_buffer->data) {
-                    memcpy(new_rx_buffer->data, working_buffer, received_length);
-                    new_rx_buffer->length = received_length;
-                    new_rx_buffer->next = device->rx_buffer;
-                    device->rx_buffer = new_rx_buffer;
-                    __SET_RX_CB(internal_flags);
-                } else {
-                    free(new_rx_buffer);
-                    device->stats.rx_errors++;
-                    __SET_ERROR_CB(internal_flags);
-                    nic_callback_t *error_cb = device->error_callbacks;
-                    while (error_cb) {
-                        if (error_cb->callback) error_cb->callback(NULL, 0);
-                        error_cb = error_cb->next;
+// One acquire load, the snapshot stays valid until the worker leaves its dispatch span
+static inline nic_callback_table_t * __nic_callbacks(nic_callback_table_t **table) {
+    return __atomic_load_n(table, __ATOMIC_ACQUIRE);
+}
+
+__thread nic_stats_shard_t __nic_thread_stats;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+#define __NIC_STATS_FIELDS      (sizeof(nic_stats_t) / sizeof(unsigned long))
+
+static void __nic_stats_accumulate(nic_stats_t *total, const nic_stats_t *stats) {
+    unsigned long *dst = (unsigned long *)total;
+    const unsigned long *src = (const unsigned long *)stats;
+    for (unsigned int i = 0; i < __NIC_STATS_FIELDS; i++) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Everything counted since nic_init, stats_lock held
+static void __nic_stats_total(nic_device_t *device, nic_stats_t *total) {
+    *total = device->stats_retired;
+    for (nic_stats_shard_t *shard = device->stats_shards; shard; shard = shard->next) {
+        __nic_stats_accumulate(total, &shard->stats);
+    }
+}
+
+// Fold the thread's counts into the device so they outlive the shard
+static void __nic_stats_unbind(nic_stats_shard_t *shard) {
+    nic_device_t *device = shard->device;
+    pthread_mutex_lock(&device->stats_lock);
+    __nic_stats_accumulate(&device->stats_retired, &shard->stats);
+    nic_stats_shard_t **link = &device->stats_shards;
+    while (*link && *link != shard) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = shard->next;
+    }
+    pthread_mutex_unlock(&device->stats_lock);
+    shard->device = NULL;
+    shard->next = NULL;
+}
+
+static void __nic_stats_thread_exit(void *arg) {
+    nic_stats_shard_t *shard = (nic_stats_shard_t *)arg;
+    if (shard->device) {
+        __nic_stats_unbind(shard);
+    }
+}
+
+static void __nic_stats_make_key(void) {
+    pthread_key_create(&stats_key, __nic_stats_thread_exit);
+}
+
+nic_stats_t * __nic_stats_bind(nic_device_t *device) {
+    nic_stats_shard_t *shard = &__nic_thread_stats;
+    // First use on this thread or the shard counts for another device
+    if (shard->device) {
+        __nic_stats_unbind(shard);
+    }
+    pthread_once(&stats_key_once, __nic_stats_make_key);
+    pthread_setspecific(stats_key, shard);
+    memset(&shard->stats, 0, sizeof(nic_stats_t));
+    pthread_mutex_lock(&device->stats_lock);
+    shard->device = device;
+    shard->next = device->stats_shards;
+    device->stats_shards = shard;
+    pthread_mutex_unlock(&device->stats_lock);
+    return &shard->stats;
+}
+
+// Shards left in other threads start over on their next use
+static void __nic_stats_detach(nic_device_t *device) {
+    pthread_mutex_lock(&device->stats_lock);
+    nic_stats_shard_t *shard = device->stats_shards;
+    while (shard) {
+        nic_stats_shard_t *next = shard->next;
+        shard->device = NULL;
+        shard->next = NULL;
+        shard = next;
+    }
+    device->stats_shards = NULL;
+    pthread_mutex_unlock(&device->stats_lock);
+}
+
+static void __nic_sum_stats(nic_device_t *device, nic_stats_t *total) {
+    pthread_mutex_lock(&device->stats_lock);
+    __nic_stats_total(device, total);
+    unsigned long *dst = (unsigned long *)total;
+    const unsigned long *base = (const unsigned long *)&device->stats_base;
+    for (unsigned int i = 0; i < __NIC_STATS_FIELDS; i++) {
+        dst[i] -= base[i];
+    }
+    pthread_mutex_unlock(&device->stats_lock);
+}
+
+static void __nic_fire_error_callbacks(nic_device_t *device) {
+    nic_callback_table_t *table = __nic_callbacks(&device->error_callbacks);
+    for (unsigned int i = 0; table && i < table->count; i++) {
+        table->callbacks[i](NULL, 0);
+    }
+}
+
+static void __nic_rx_enqueue(nic_queue_t *queue, nic_packet_t *pkt) {
+    nic_device_t *device = queue->device;
+    nic_rx_overflow_t policy = device->config.rx_overflow;
+    if (policy == NIC_RX_CALLBACKS_ONLY) {
+        if (__nic_callbacks(&device->rx_callbacks) || __nic_callbacks(&device->rx_pkt_callbacks) ||
+            __nic_callbacks(&device->rx_batch_callbacks)) {
+            return; // Delivered through the callbacks only, nothing to copy
+        }
+        policy = NIC_RX_DROP_NEWEST;
+    }
+    // Check for room before paying for the copy
+    if (policy == NIC_RX_DROP_NEWEST && __nic_ring_count(device->rx_ring) > device->rx_ring->mask) {
+        NIC_STATS_ADD(device, rx_dropped_full, 1);
+        return;
+    }
+    nic_packet_t *rx_pkt = nic_packet_copy(device->pool, pkt);
+    if (!rx_pkt) {
+        NIC_STATS_ADD(device, rx_dropped_nobuf, 1);
+        __nic_fire_error_callbacks(device);
+        return;
+    }
+    while (!__nic_ring_push(device->rx_ring, rx_pkt, rx_pkt->len)) {
+        void *old_pkt;
+        unsigned int old_length;
+        if (policy == NIC_RX_DROP_NEWEST) {
+            nic_packet_release(rx_pkt);
+            NIC_STATS_ADD(device, rx_dropped_full, 1);
+            return;
+        }
+        // A reader may empty the slot first, then the retry just succeeds
+        if (__nic_ring_pop(device->rx_ring, &old_pkt, &old_length)) {
+            nic_packet_release((nic_packet_t *)old_pkt);
+            NIC_STATS_ADD(device, rx_dropped_oldest, 1);
+        }
+    }
+    // Track the deepest backlog so overload shows up before frames are dropped
+    unsigned long depth = __nic_ring_count(device->rx_ring);
+    unsigned long high = __atomic_load_n(&device->rx_high_watermark, __ATOMIC_RELAXED);
+    while (depth > high &&
+           !__atomic_compare_exchange_n(&device->rx_high_watermark, &high, depth, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void __nic_rx_frame(nic_queue_t *queue, void *data, unsigned int length, unsigned long long tstamp) {
+    nic_device_t *device = queue->device;
+    //Update rx statistics
+    NIC_STATS_ADD(device, rx_packets, 1);
+    NIC_STATS_ADD(device, rx_bytes, length);
+    //Describe the frame where it was received (ring memory or working buffer), no copy
+    nic_packet_t pkt;
+    nic_packet_wrap(&pkt, data, length);
+    pkt.tstamp = tstamp;
+    //Copy received data into the rx queue for nic_receive_packet
+    __nic_rx_enqueue(queue, &pkt);
+    nic_callback_table_t *table = __nic_callbacks(&device->rx_callbacks);
+    for (unsigned int i = 0; table && i < table->count; i++) {
+        table->callbacks[i](data, length);
+    }
+    table = __nic_callbacks(&device->rx_pkt_callbacks);
+    for (unsigned int i = 0; table && i < table->count; i++) {
+        ((nic_packet_callback_t)(void *)table->callbacks[i])(&pkt);
+    }
+}
+
+static void __nic_rx_fire_batch(nic_device_t *device, nic_packet_t *batch, unsigned int count) {
+    nic_callback_table_t *table = __nic_callbacks(&device->rx_batch_callbacks);
+    for (unsigned int i = 0; table && i < table->count; i++) {
+        ((nic_batch_callback_t)(void *)table->callbacks[i])(batch, count);
+    }
+}
+
+static unsigned long long __nic_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static unsigned long long __nic_uptime_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Drain up to budget frames (0 means every ready one) and return how many were
+// handled. A ring block cut short by the budget stays in the queue for next round.
+// The working buffer holds NIC_RX_BATCH_SIZE frames so a whole batch stays
+// valid until its callbacks return, ring frames stay valid until their block is released
+static unsigned int __nic_rx_drain(nic_queue_t *queue, int use_ring, unsigned char *working_buffer,
+                                   unsigned int budget) {
+    nic_device_t *device = queue->device;
+    nic_packet_t batch[NIC_RX_BATCH_SIZE];
+    unsigned int batch_count = 0;
+    unsigned int drained = 0;
+    void *frame;
+    unsigned int frame_length;
+    unsigned long long tstamp;
+    int batching = __nic_callbacks(&device->rx_batch_callbacks) != NULL;
+    if (use_ring) {
+        hal_rx_block_t *block = &queue->rx_block;
+        while (!budget || drained < budget) {
+            if (!block->block && !hal_rx_block_acquire(queue->hw_handle, block)) {
+                break;
+            }
+            while ((!budget || drained < budget) &&
+                   hal_rx_block_next_frame(block, &frame, &frame_length, &tstamp)) {
+                __nic_rx_frame(queue, frame, frame_length, tstamp);
+                drained++;
+                if (batching) {
+                    nic_packet_wrap(&batch[batch_count], frame, frame_length);
+                    batch[batch_count].tstamp = tstamp;
+                    if (++batch_count == NIC_RX_BATCH_SIZE) {
+                        __nic_rx_fire_batch(device, batch, batch_count);
+                        batch_count = 0;
                     }
                 }
             }
+            if (batch_count) {
+                __nic_rx_fire_batch(device, batch, batch_count);
+                batch_count = 0;
+            }
+            if (block->frame_index < block->num_frames) {
+                break; // Budget spent halfway through the block
+            }
+            hal_rx_block_release(queue->hw_handle, block);
+        }
+    } else {
+        unsigned int buffer_length = device->max_mtu+NIC_EXTRA_SIZE;
+        frame = working_buffer;
+        while ((!budget || drained < budget) &&
+               (frame_length = hal_receive(queue->hw_handle, frame, buffer_length)) > 0) {
+            tstamp = __nic_now_ns();
+            __nic_rx_frame(queue, frame, frame_length, tstamp);
+            drained++;
+            if (batching) {
+                nic_packet_wrap(&batch[batch_count], frame, frame_length);
+                batch[batch_count].tstamp = tstamp;
+                if (++batch_count == NIC_RX_BATCH_SIZE) {
+                    __nic_rx_fire_batch(device, batch, batch_count);
+                    batch_count = 0;
+                }
+            }
+            frame = working_buffer + batch_count * buffer_length;
+        }
+        if (batch_count) {
+            __nic_rx_fire_batch(device, batch, batch_count);
+        }
+    }
+    return drained;
+}
+
+static void __nic_kick(nic_device_t *device) {
+    // Only the first producer after the worker went idle pays the syscall
+    if (!__atomic_exchange_n(&device->tx_kick_pending, 1, __ATOMIC_SEQ_CST)) {
+        eventfd_write(device->queues[device->tx_queue].event_fd, 1);
+    }
+}
+
+// Fire the tx completion callbacks, stamped with the time the batch finished
+static void __nic_tx_complete(nic_device_t *device, nic_tx_completion_t *completions, unsigned int count) {
+    unsigned long long tstamp = __nic_now_ns();
+    for (unsigned int i = 0; i < count; i++) {
+        completions[i].tstamp = tstamp;
+    }
+    nic_callback_table_t *table = __nic_callbacks(&device->tx_completion_callbacks);
+    for (unsigned int i = 0; table && i < table->count; i++) {
+        ((nic_tx_completion_callback_t)(void *)table->callbacks[i])(completions, count);
+    }
+}
+
+// Send everything in the tx ring, one syscall per batch, then fire the tx callbacks.
+// Returns the frames taken off the ring.
+static unsigned int __nic_tx_flush(nic_queue_t *queue) {
+    nic_device_t *device = queue->device;
+    flags_t internal_flags = __TX_FLAGS_NONE;
+    unsigned int flushed = 0;
+    for (;;) {
+        // Frames the socket had no room for last time go first, then the ring
+        hal_tx_frame_t batch[HAL_TX_BATCH_SIZE];
+        nic_packet_t **tx_pkts = device->tx_backlog;
+        nic_tx_completion_t completions[HAL_TX_BATCH_SIZE];
+        unsigned int batch_count = device->tx_backlog_count;
+        unsigned int completion_count = 0;
+        void *tx_pkt;
+        unsigned int tx_length;
+        while (batch_count < HAL_TX_BATCH_SIZE && __nic_ring_pop(device->tx_ring, &tx_pkt, &tx_length)) {
+            tx_pkts[batch_count++] = (nic_packet_t *)tx_pkt;
+        }
+        if (batch_count == 0) {
+            break;
         }
-        //Step 2: Send packets from tx buffer to hardware
-        nic_buffer_t *tx_buf = device->tx_buffer;
-        while (tx_buf) {
-            unsigned int sent_length = hal_send(device->hw_handle, tx_buf->data, tx_buf->length);
-            if (sent_length == tx_buf->length) {
-                device->stats.tx_packets++;
+        for (unsigned int i = 0; i < batch_count; i++) {
+            batch[i].data = nic_packet_data(tx_pkts[i]);
+            batch[i].length = tx_pkts[i]->len;
+        }
+        unsigned int done = hal_send_batch(queue->hw_handle, batch, batch_count);
+        for (unsigned int i = 0; i < done; i++) {
+            if (batch[i].sent == batch[i].length) {
+                NIC_STATS_ADD(device, tx_packets, 1);
+                NIC_STATS_ADD(device, tx_bytes, batch[i].length);
                 __SET_TX_CB(internal_flags);
             } else {
-                device->stats.tx_errors++;
+                NIC_STATS_ADD(device, tx_errors, 1);
                 __SET_ERROR_CB(internal_flags);
-                nic_callback_t *error_cb = device->error_callbacks;
-                while (error_cb) {
-                    if (error_cb->callback) error_cb->callback(NULL, 0);
-                    error_cb = error_cb->next;
-                }
             }
-            nic_buffer_t *temp = tx_buf;
-            tx_buf = tx_buf->next;
-            free(temp->data);
-            free(temp);
+            // Read the cookie first, the release may hand the buffer to another thread
+            if (tx_pkts[i]->flags & NIC_PKT_F_NOTIFY) {
+                completions[completion_count].cookie = tx_pkts[i]->cookie;
+                completions[completion_count].status = batch[i].sent == batch[i].length ? STATUS_OK : STATUS_ERROR;
+                completion_count++;
+            }
+            nic_packet_release(tx_pkts[i]);
+        }
+        // Keep what did not fit, in order, for the next round, and why it did not
+        if (done < batch_count) {
+            device->tx_backlog_errno = errno;
+        }
+        memmove(tx_pkts, tx_pkts + done, (batch_count - done) * sizeof(*tx_pkts));
+        device->tx_backlog_count = batch_count - done;
+        if (completion_count) {
+            __nic_tx_complete(device, completions, completion_count);
+        }
+        flushed += done;
+        if (device->tx_backlog_count) {
+            break;
         }
-        device->tx_buffer = NULL;
-        //Step 3: Trigger callbacks based on internal flags
-        if (__GET_RX_CB(internal_flags)) {
-            nic_callback_t *cb = device->rx_callbacks;
-            while (cb) {
-                if (cb->callback) cb->callback(working_buffer, received_length);
-                cb = cb->next;
+    }
+    //Trigger callbacks based on internal flags, once per flush
+    if (__GET_ERROR_CB(internal_flags)) {
+        __nic_fire_error_callbacks(device);
+    }
+    if (__GET_TX_CB(internal_flags)) {
+        nic_callback_table_t *table = __nic_callbacks(&device->tx_callbacks);
+        for (unsigned int i = 0; table && i < table->count; i++) {
+            table->callbacks[i](NULL, 0);
+        }
+    }
+    return flushed;
+}
+
+// Timeout in usecs for the next wait: 0 keeps polling, -1 blocks until traffic or a tx kick,
+// anything else is a coalescing hold-off during which only a tx kick ends the wait early
+static int __nic_next_timeout(nic_queue_t *queue, unsigned int work, int budget_spent) {
+    nic_device_t *device = queue->device;
+    if (budget_spent) {
+        return 0; // Frames are still waiting
+    }
+    if (__atomic_load_n(&device->config.poll.mode, __ATOMIC_RELAXED) == NIC_POLL_ADAPTIVE) {
+        unsigned long long now = __nic_uptime_ns();
+        unsigned int idle_usecs = __atomic_load_n(&device->config.poll.idle_usecs, __ATOMIC_RELAXED);
+        if (work) {
+            queue->last_work = now;
+        }
+        if (!idle_usecs) {
+            idle_usecs = NIC_DEFAULT_IDLE_USECS;
+        }
+        return (now - queue->last_work < idle_usecs * 1000ULL) ? 0 : -1;
+    }
+    // Light round: give frames time to pile up so the next wakeup pays for more of them.
+    // The tx worker sends as soon as frames come in.
+    if (queue->index >= device->num_queues) {
+        return -1;
+    }
+    unsigned int max_frames = __atomic_load_n(&device->config.coalesce.max_frames, __ATOMIC_RELAXED);
+    unsigned int max_usecs = __atomic_load_n(&device->config.coalesce.max_usecs, __ATOMIC_RELAXED);
+    if (work && work < max_frames && max_usecs) {
+        return max_usecs > INT_MAX ? INT_MAX : (int)max_usecs;
+    }
+    return -1;
+}
+
+// Run the timer callback on the tx worker, usecs until it is due again or -1
+static int __nic_run_timer(nic_device_t *device) {
+    nic_timer_callback_t timer = __atomic_load_n(&device->timer_callback, __ATOMIC_ACQUIRE);
+    if (!timer) {
+        return -1;
+    }
+    int msecs = timer();
+    if (msecs < 0) {
+        return -1;
+    }
+    return msecs > INT_MAX / 1000 ? INT_MAX : msecs * 1000;
+}
+
+// epoll_pwait2 (usec timeouts) needs Linux 5.11, cleared the first time it is missing
+static int __nic_has_pwait2 = 1;
+
+// Change what the worker waits for on its socket, only when it differs from the last time
+static void __nic_watch_socket(nic_queue_t *queue, int epoll_fd, unsigned int socket_events) {
+    if (socket_events != queue->socket_events) {
+        struct epoll_event ev = { .events = socket_events, .data.fd = hal_get_fd(queue->hw_handle) };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev);
+        queue->socket_events = socket_events;
+    }
+}
+
+// Wait for the next round, at most until the timer is due (both in usecs). A hold-off leaves
+// rx frames out of the wait, so they keep piling up while a tx kick still wakes the worker
+// and nic_send_pkt traffic is not delayed. wait_writable also wakes it once the socket has
+// room for the frames held back by a full buffer
+static int __nic_wait(nic_queue_t *queue, int epoll_fd, struct epoll_event *events, int max_events,
+                      int timeout, int timer, int wait_writable) {
+    int is_rx_queue = queue->index < queue->device->num_queues;
+    unsigned int socket_events = (is_rx_queue && timeout <= 0 ? EPOLLIN : 0) | (wait_writable ? EPOLLOUT : 0);
+    if (is_rx_queue || queue->index == queue->device->tx_queue) {
+        __nic_watch_socket(queue, epoll_fd, socket_events);
+    }
+    if (timer >= 0 && (timeout < 0 || timer < timeout)) {
+        timeout = timer;
+    }
+    int ready = -1;
+    if (timeout > 0 && __atomic_load_n(&__nic_has_pwait2, __ATOMIC_RELAXED)) {
+        struct timespec wait = { timeout / 1000000, (timeout % 1000000) * 1000 };
+        ready = epoll_pwait2(epoll_fd, events, max_events, &wait, NULL);
+        if (ready < 0 && errno == ENOSYS) {
+            // Before Linux 5.11: stay with millisecond waits from now on
+            __atomic_store_n(&__nic_has_pwait2, 0, __ATOMIC_RELAXED);
+        } else {
+            return ready < 0 ? 0 : ready;
+        }
+    }
+    // Rounded up, a hold-off or timer never ends before it is due
+    ready = epoll_wait(epoll_fd, events, max_events, timeout > 0 ? (timeout + 999) / 1000 : timeout);
+    // EINTR (or any failed wait) is just an empty round
+    return ready < 0 ? 0 : ready;
+}
+
+static void __nic_to_cpuset(const nic_cpu_mask_t *mask, cpu_set_t *set) {
+    CPU_ZERO(set);
+    for (unsigned int cpu = 0; cpu < NIC_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (nic_cpu_mask_isset(mask, cpu)) {
+            CPU_SET(cpu, set);
+        }
+    }
+}
+
+static void __nic_from_cpuset(const cpu_set_t *set, nic_cpu_mask_t *mask) {
+    memset(mask, 0, sizeof(nic_cpu_mask_t));
+    for (unsigned int cpu = 0; cpu < NIC_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set)) {
+            nic_cpu_mask_set(mask, cpu);
+        }
+    }
+}
+
+// Pin the worker to its requested CPUs, or let it run anywhere again when unpinned
+static status_t __nic_apply_affinity(nic_queue_t *queue, pthread_t thread) {
+    cpu_set_t set;
+    if (queue->pinned) {
+        __nic_to_cpuset(&queue->cpus, &set);
+    } else {
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0 ? STATUS_OK : STATUS_INVALID_PARAM;
+}
+
+static status_t __nic_apply_sched(pthread_t thread, const nic_sched_t *sched) {
+    struct sched_param param = { .sched_priority = sched->priority };
+    // SCHED_FIFO needs CAP_SYS_NICE (or an RLIMIT_RTPRIO allowance)
+    return pthread_setschedparam(thread, sched->policy, &param) == 0 ? STATUS_OK : STATUS_ERROR;
+}
+
+// Field 39 of /proc/<pid>/task/<tid>/stat is the CPU the task last ran on
+static int __nic_last_cpu(int tid) {
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[length] = '\0';
+    // The command name may contain spaces, count fields from its closing parenthesis
+    char *field = strrchr(stat, ')');
+    if (!field) {
+        return -1;
+    }
+    for (int i = 2; i < 39 && field; i++) {
+        field = strchr(field + 1, ' ');
+    }
+    return field ? atoi(field + 1) : -1;
+}
+
+void __nic_thread(void * args) {
+    nic_queue_t *queue = (nic_queue_t *)args;
+    nic_device_t *device = queue->device;
+    //Main NIC processing loop, one per queue, waits in epoll until its socket or eventfd fires
+    //(or keeps polling while traffic flows in adaptive mode)
+    //1) drain ready rx frames up to the budget, update stats and trigger rx callbacks
+    //2) on the tx queue, send everything in the tx ring to hardware and update stats
+    //3) trigger tx callbacks as needed
+    //A dedicated tx worker skips step 1 and only waits on its eventfd
+    unsigned char *working_buffer = NULL;
+    int is_rx_queue = (queue->index < device->num_queues);
+    int is_tx_queue = (queue->index == device->tx_queue);
+    int use_ring = is_rx_queue && hal_rx_ring_enabled(queue->hw_handle);
+    int timeout = -1;
+    int timer = -1;
+    int wait_writable = 0;
+
+    // Settle on the requested CPUs first so the buffers below are touched there
+    queue->tid = gettid();
+    if (queue->pinned) {
+        __nic_apply_affinity(queue, pthread_self());
+    }
+    if (device->sched.policy != SCHED_OTHER) {
+        __nic_apply_sched(pthread_self(), &device->sched);
+    }
+
+    if (is_rx_queue && !use_ring) {
+        working_buffer = malloc(NIC_RX_BATCH_SIZE * (device->max_mtu+NIC_EXTRA_SIZE));
+    }
+    int epoll_fd = (!is_rx_queue || use_ring || working_buffer) ? epoll_create1(0) : -1;
+    if (epoll_fd < 0) {
+        NIC_STATS_ADD(device, rx_errors, 1);
+        __nic_rcu_enter(queue);
+        __nic_fire_error_callbacks(device);
+        __nic_rcu_exit(queue);
+        free(working_buffer);
+        return;
+    }
+    // The tx worker watches the socket too, but only for room to send while tx is backed up
+    struct epoll_event ev = { .events = is_rx_queue ? EPOLLIN : 0 };
+    if (is_rx_queue || is_tx_queue) {
+        ev.data.fd = hal_get_fd(queue->hw_handle);
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+        queue->socket_events = ev.events;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = queue->event_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+
+    while (device->is_up) {
+        struct epoll_event events[2];
+        // With SO_BUSY_POLL set, a zero timeout wait spins on the device queue
+        int ready = __nic_wait(queue, epoll_fd, events, 2, timeout, timer, wait_writable);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.fd == queue->event_fd) {
+                eventfd_t kicks;
+                eventfd_read(queue->event_fd, &kicks);
             }
         }
-        if (__GET_TX_CB(internal_flags)) {
-            nic_callback_t *cb = device->tx_callbacks;
-            while (cb) {
-                if (cb->callback) cb->callback(NULL, 0);
-                cb = cb->next;
+        unsigned int budget = __atomic_load_n(&device->config.rx_budget, __ATOMIC_RELAXED);
+        //Callback tables loaded from here on stay valid until __nic_rcu_exit
+        __nic_rcu_enter(queue);
+        if (is_tx_queue) {
+            __atomic_store_n(&device->tx_kick_pending, 0, __ATOMIC_SEQ_CST);
+        }
+        //Step 1: Receive ready packets from hardware
+        unsigned int received = is_rx_queue ? __nic_rx_drain(queue, use_ring, working_buffer, budget) : 0;
+        unsigned int work = received;
+        //Step 2 and 3: the tx queue flushes the tx ring (receive-only queues skip it)
+        if (is_tx_queue) {
+            work += __nic_tx_flush(queue);
+        }
+        __nic_rcu_exit(queue);
+        timeout = __nic_next_timeout(queue, work, budget && received >= budget);
+        timer = is_tx_queue ? __nic_run_timer(device) : -1;
+        // Tx backed up: wait for room in the socket buffer. A full queueing discipline
+        // (ENOBUFS) leaves the socket writable, so that one retries after a short pause
+        wait_writable = 0;
+        if (is_tx_queue && device->tx_backlog_count) {
+            int backlog_errno = device->tx_backlog_errno;
+            if (backlog_errno == EAGAIN || backlog_errno == EWOULDBLOCK) {
+                wait_writable = 1;
+            } else if (backlog_errno == ENOBUFS) {
+                timer = (timer < 0 || timer > NIC_TX_RETRY_USECS) ? NIC_TX_RETRY_USECS : timer;
+            } else {
+                timeout = 0;
             }
         }
-        //Sleep or yield to avoid busy waiting
-        usleep(1000); // Sleep for 1ms
     }
+    close(epoll_fd);
+    free(working_buffer);
 }
 
 status_t __nic_thread_control(nic_device_t *device, int start) {
     if (start) {
         device->is_up = 1;
-        if (pthread_create(&device->thread, NULL, (void *)__nic_thread, (void *)device) != 0) {
-            device->is_up = 0;
-            return STATUS_ERROR;
+        for (unsigned int i = 0; i < device->num_workers; i++) {
+            nic_queue_t *queue = &device->queues[i];
+            if (pthread_create(&queue->thread, NULL, (void *)__nic_thread, (void *)queue) != 0) {
+                //Stop the workers already running
+                device->is_up = 0;
+                while (i-- > 0) {
+                    eventfd_write(device->queues[i].event_fd, 1);
+                    pthread_join(device->queues[i].thread, NULL);
+                }
+                return STATUS_ERROR;
+            }
         }
         return STATUS_OK;
     } else {
+        status_t status = STATUS_OK;
+        if (!device->is_up) {
+            return STATUS_OK; // Already stopped (NIC_IOCTL_DOWN before shutdown)
+        }
         device->is_up = 0;
-        if (pthread_join(device->thread, NULL) != 0) {
+        //Wake every worker so it sees is_up cleared
+        for (unsigned int i = 0; i < device->num_workers; i++) {
+            eventfd_write(device->queues[i].event_fd, 1);
+        }
+        for (unsigned int i = 0; i < device->num_workers; i++) {
+            if (pthread_join(device->queues[i].thread, NULL) != 0) {
+                status = STATUS_ERROR;
+            }
+        }
+        return status;
+    }
+}
+
+static void __nic_release_queues(nic_device_t *device) {
+    for (unsigned int i = 0; i < device->num_workers; i++) {
+        nic_queue_t *queue = &device->queues[i];
+        if (queue->event_fd >= 0) {
+            close(queue->event_fd);
+        }
+        // Queue 0 and the tx worker share the device hardware handle, released by the caller
+        if (queue->hw_handle && queue->hw_handle != device->hw_handle) {
+            hal_remove_device(queue->hw_handle);
+        }
+        queue->hw_handle = NULL;
+        queue->event_fd = -1;
+    }
+    device->num_workers = 0;
+}
+
+static status_t __nic_setup_queues(nic_device_t *device) {
+    unsigned int count = device->config.rx_queues;
+    if (count == 0) {
+        count = 1;
+    }
+    if (count > NIC_MAX_QUEUES) {
+        count = NIC_MAX_QUEUES;
+    }
+
+    // Fanout groups are per network namespace, derive an id unique to this device
+    device_handle *primary = (device_handle *)device->hw_handle;
+    unsigned short fanout_group = (unsigned short)((getpid() << 4) ^ primary->index);
+
+    for (unsigned int i = 0; i < count; i++) {
+        nic_queue_t *queue = &device->queues[i];
+        memset(queue, 0, sizeof(nic_queue_t));
+        queue->device = device;
+        queue->index = i;
+        queue->event_fd = -1;
+        device->num_queues = i + 1;
+        device->num_workers = i + 1;
+
+        queue->hw_handle = (i == 0) ? device->hw_handle : hal_create_device();
+        if (!queue->hw_handle) {
+            __nic_release_queues(device);
             return STATUS_ERROR;
         }
-        return STATUS_OK;
+        ((device_handle *)queue->hw_handle)->owner = device;
+        if (count > 1 && hal_join_fanout(queue->hw_handle, fanout_group) < 0) {
+            __nic_release_queues(device);
+            return STATUS_ERROR;
+        }
+        queue->event_fd = eventfd(0, EFD_NONBLOCK);
+        if (queue->event_fd < 0) {
+            __nic_release_queues(device);
+            return STATUS_ERROR;
+        }
+    }
+
+    // The tx worker sends through the socket of queue 0, rx stays with the queues
+    device->tx_queue = 0;
+    if (device->config.tx_thread) {
+        nic_queue_t *queue = &device->queues[count];
+        memset(queue, 0, sizeof(nic_queue_t));
+        queue->device = device;
+        queue->index = count;
+        queue->hw_handle = device->hw_handle;
+        queue->event_fd = eventfd(0, EFD_NONBLOCK);
+        device->num_workers = count + 1;
+        if (queue->event_fd < 0) {
+            __nic_release_queues(device);
+            return STATUS_ERROR;
+        }
+        device->tx_queue = count;
+    }
+    return STATUS_OK;
+}
+
+// Socket side of the poll mode, best effort: busy polling above net.core.busy_read
+// needs CAP_NET_ADMIN, the worker still polls without it
+static void __nic_apply_poll_mode(nic_device_t *device) {
+    int adaptive = (device->config.poll.mode == NIC_POLL_ADAPTIVE);
+    unsigned int busy_poll_usecs = device->config.poll.busy_poll_usecs ?
+                                   device->config.poll.busy_poll_usecs : NIC_DEFAULT_BUSY_POLL_USECS;
+    for (unsigned int i = 0; i < device->num_queues; i++) {
+        hal_set_busy_poll(device->queues[i].hw_handle, adaptive ? busy_poll_usecs : 0);
+        hal_set_qdisc_bypass(device->queues[i].hw_handle, adaptive);
+    }
+}
+
+// A queued frame that will never leave, its owner gets a failed completion
+static void __nic_tx_cancel(nic_device_t *device, nic_packet_t *pkt) {
+    if (pkt->flags & NIC_PKT_F_NOTIFY) {
+        nic_tx_completion_t completion = { .cookie = pkt->cookie, .status = STATUS_ERROR };
+        nic_packet_release(pkt);
+        __nic_tx_complete(device, &completion, 1);
+    } else {
+        nic_packet_release(pkt);
     }
 }
 
+// Undo nic_init, only what was already set up is released
+static void __nic_release_resources(nic_device_t *device) {
+    __nic_release_queues(device);
+    for (unsigned int i = 0; i < device->tx_backlog_count; i++) {
+        nic_packet_release(device->tx_backlog[i]);
+    }
+    device->tx_backlog_count = 0;
+    if (device->tx_ring) {
+        void *tx_pkt;
+        unsigned int tx_length;
+        while (__nic_ring_pop(device->tx_ring, &tx_pkt, &tx_length)) {
+            nic_packet_release((nic_packet_t *)tx_pkt);
+        }
+        __nic_ring_destroy(device->tx_ring);
+        device->tx_ring = NULL;
+    }
+    if (device->rx_ring) {
+        void *rx_pkt;
+        unsigned int rx_length;
+        while (__nic_ring_pop(device->rx_ring, &rx_pkt, &rx_length)) {
+            nic_packet_release((nic_packet_t *)rx_pkt);
+        }
+        __nic_ring_destroy(device->rx_ring);
+        device->rx_ring = NULL;
+    }
+    nic_packet_release(device->rx_pending);
+    device->rx_pending = NULL;
+    if (device->pool) {
+        nic_pool_destroy(device->pool);
+        device->pool = NULL;
+    }
+    pthread_mutex_destroy(&device->rx_lock);
+    pthread_mutex_destroy(&device->callback_lock);
+    __nic_stats_detach(device);
+    pthread_mutex_destroy(&device->stats_lock);
+    hal_remove_device(device->hw_handle);
+    device->hw_handle = NULL;
+}
+
 status_t nic_init(nic_device_t *device) {
     // Initialize the NIC device (e.g., allocate resources, set default values)
     if (!device) {
@@ -166,33 +1013,86 @@ status_t nic_init(nic_device_t *device) {
         device->mac_address[i] = default_mac[i];
     }
 
-    // Set statistics to zero
-    device->stats.tx_packets = 0;
-    device->stats.rx_packets = 0;
-    device->stats.tx_errors = 0;
-    device->stats.rx_errors = 0;
-    device->stats.collisions = 0;
-
     // Set underlying hardware handle
     device->hw_handle = hal_create_device();
     if (!device->hw_handle) {
         return STATUS_ERROR;
     }
     device->mtu = hal_get_mtu(device->hw_handle);
+    if (device->mtu > NIC_MAX_MTU) {
+        device->mtu = NIC_MAX_MTU;  // Loopback reports 64KiB
+    }
+    // Room for the largest MTU allowed later, raising it must not outgrow the buffers
+    device->max_mtu = device->config.max_mtu > device->mtu ? device->config.max_mtu : device->mtu;
+    if (device->max_mtu > NIC_MAX_MTU) {
+        device->max_mtu = NIC_MAX_MTU;
+    }
     hal_get_mac_address(device->hw_handle, device->mac_address);
 
     // Initialize internal buffers and callback lists to NULL
-    device->rx_buffer = NULL;
-    device->tx_buffer = NULL;
+    device->rx_ring = NULL;
+    device->rx_pending = NULL;
+    device->rx_high_watermark = 0;
     device->rx_callbacks = NULL;
+    device->rx_pkt_callbacks = NULL;
+    device->rx_batch_callbacks = NULL;
     device->tx_callbacks = NULL;
+    device->tx_completion_callbacks = NULL;
     device->error_callbacks = NULL;
+    device->retired_callbacks = NULL;
+    device->timer_callback = NULL;
+    device->sched.policy = SCHED_OTHER;
+    device->sched.priority = 0;
+    pthread_mutex_init(&device->callback_lock, NULL);
+    device->stats_shards = NULL;
+    memset(&device->stats_retired, 0, sizeof(nic_stats_t));
+    memset(&device->stats_base, 0, sizeof(nic_stats_t));
+    pthread_mutex_init(&device->stats_lock, NULL);
+    device->tx_ring = NULL;
+    device->pool = NULL;
+    device->num_queues = 0;
+    device->num_workers = 0;
+    device->tx_queue = 0;
+    device->tx_kick_pending = 0;
+    device->tx_backlog_count = 0;
+    pthread_mutex_init(&device->rx_lock, NULL);
+
+    // Preallocate every frame buffer the data path will use, each one holds a
+    // packet descriptor, the headroom for tx headers and a full frame
+    device->pool = nic_pool_create(device->config.pool_size ? device->config.pool_size : NIC_POOL_DEFAULT_SIZE,
+                                   sizeof(nic_packet_t) + NIC_PKT_HEADROOM + device->max_mtu + NIC_EXTRA_SIZE,
+                                   device->config.pool_hugepages);
+    if (!device->pool) {
+        __nic_release_resources(device);
+        return STATUS_ERROR;
+    }
+
+    device->rx_ring = __nic_ring_create(device->config.rx_queue_size ?
+                                        device->config.rx_queue_size : NIC_DEFAULT_RX_QUEUE_SIZE);
+    if (!device->rx_ring) {
+        __nic_release_resources(device);
+        return STATUS_ERROR;
+    }
+
+    device->tx_ring = __nic_ring_create(device->config.tx_ring_size ?
+                                        device->config.tx_ring_size : NIC_DEFAULT_TX_RING_SIZE);
+    if (!device->tx_ring) {
+        __nic_release_resources(device);
+        return STATUS_ERROR;
+    }
+
+    // Open one packet socket per queue, protocol code only sees the hardware
+    // handles so each of them points back here. Statistics start at zero.
+    if (__nic_setup_queues(device) != STATUS_OK) {
+        __nic_release_resources(device);
+        return STATUS_ERROR;
+    }
+    __nic_apply_poll_mode(device);
 
-    // Init the thread for NIC processing
+    // Init the threads for NIC processing
     device->is_up = 0;
     if (__nic_thread_control(device, 1) != STATUS_OK) {
-        hal_remove_device(device->hw_handle);
-        device->hw_handle = NULL;
+        __nic_release_resources(device);
         return STATUS_ERROR;
     }
 
@@ -206,46 +1106,39 @@ status_t nic_shutdown(nic_device_t *device) {
         return STATUS_INVALID_PARAM;
     }
 
-    // Stop the NIC processing thread
+    // Stop the NIC processing threads
     if (__nic_thread_control(device, 0) != STATUS_OK) {
         return STATUS_ERROR;
     }
 
-    // Free internal buffers
-    nic_buffer_t *buf;
-    while (device->rx_buffer) {
-        buf = device->rx_buffer;
-        device->rx_buffer = buf->next;
-        free(buf->data);
-        free(buf);
-    }
-    while (device->tx_buffer) {
-        buf = device->tx_buffer;
-        device->tx_buffer = buf->next;
-        free(buf->data);
-        free(buf);
-    }
-    // Free callback lists
-    nic_callback_t *cb;
-    while (device->rx_callbacks) {
-        cb = device->rx_callbacks;
-        device->rx_callbacks = cb->next;
-        free(cb);
+    // Frames still queued will never leave, tell their owners
+    for (unsigned int i = 0; i < device->tx_backlog_count; i++) {
+        __nic_tx_cancel(device, device->tx_backlog[i]);
     }
-    while (device->tx_callbacks) {
-        cb = device->tx_callbacks;
-        device->tx_callbacks = cb->next;
-        free(cb);
-    }
-    while (device->error_callbacks) {
-        cb = device->error_callbacks;
-        device->error_callbacks = cb->next;
-        free(cb);
+    device->tx_backlog_count = 0;
+    void *tx_pkt;
+    unsigned int tx_length;
+    while (__nic_ring_pop(device->tx_ring, &tx_pkt, &tx_length)) {
+        __nic_tx_cancel(device, (nic_packet_t *)tx_pkt);
     }
 
-    // Remove hardware handle
-    hal_remove_device(device->hw_handle);
-    device->hw_handle = NULL;
+    // Free callback tables, no worker is left to read them
+    free(device->rx_callbacks);
+    free(device->rx_pkt_callbacks);
+    free(device->rx_batch_callbacks);
+    free(device->tx_callbacks);
+    free(device->tx_completion_callbacks);
+    free(device->error_callbacks);
+    device->rx_callbacks = NULL;
+    device->rx_pkt_callbacks = NULL;
+    device->rx_batch_callbacks = NULL;
+    device->tx_callbacks = NULL;
+    device->tx_completion_callbacks = NULL;
+    device->error_callbacks = NULL;
+    __nic_free_retired_callbacks(device);
+
+    // Free internal buffers, the pool and the hardware handles
+    __nic_release_resources(device);
 
     // Additional shutdown code here
     return STATUS_OK;
@@ -266,62 +1159,123 @@ status_t nic_ioctl(nic_device_t *device, unsigned int command, void *arg) {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            device->mtu = *(unsigned int *)arg;
+            unsigned int mtu = *(unsigned int *)arg;
+            if (!device->hw_handle) {
+                return STATUS_ERROR;
+            }
+            if (mtu < NIC_MIN_MTU || mtu > device->max_mtu) {
+                return STATUS_INVALID_PARAM;
+            }
+            // The interface first, the stack only uses the new size once frames can carry it
+            if (hal_set_mtu(device->hw_handle, mtu) != 0) {
+                return STATUS_ERROR;
+            }
+            for (unsigned int i = 1; i < device->num_queues; i++) {
+                hal_set_mtu(device->queues[i].hw_handle, mtu);
+            }
+            device->mtu = mtu;
             return STATUS_OK;
         }
         case NIC_IOCTL_GET_STATS: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            *(nic_stats_t *)arg = device->stats;
+            __nic_sum_stats(device, (nic_stats_t *)arg);
             return STATUS_OK;
         }
         case NIC_IOCTL_RESET_STATS: {
             if (!device) {
                 return STATUS_INVALID_PARAM;
             }
-            device->stats.tx_packets = 0;
-            device->stats.rx_packets = 0;
-            device->stats.tx_errors = 0;
-            device->stats.rx_errors = 0;
-            device->stats.collisions = 0;
+            // Shards are only written by their threads, move the zero point instead
+            pthread_mutex_lock(&device->stats_lock);
+            __nic_stats_total(device, &device->stats_base);
+            pthread_mutex_unlock(&device->stats_lock);
+            __atomic_store_n(&device->rx_high_watermark, __nic_ring_count(device->rx_ring), __ATOMIC_RELAXED);
             return STATUS_OK;
         }
         case NIC_IOCTL_ADD_RX_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_add_callback(&device->rx_callbacks, (nic_event_callback_t)arg);
+            return __nic_add_callback(device, &device->rx_callbacks, (nic_event_callback_t)arg);
         }
         case NIC_IOCTL_REMOVE_RX_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_remove_callback(&device->rx_callbacks, (nic_event_callback_t)arg);
+            return __nic_remove_callback(device, &device->rx_callbacks, (nic_event_callback_t)arg);
+        }
+        case NIC_IOCTL_ADD_RX_PKT_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_add_callback(device, &device->rx_pkt_callbacks, (nic_event_callback_t)arg);
+        }
+        case NIC_IOCTL_REMOVE_RX_PKT_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_remove_callback(device, &device->rx_pkt_callbacks, (nic_event_callback_t)arg);
+        }
+        case NIC_IOCTL_ADD_RX_BATCH_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_add_callback(device, &device->rx_batch_callbacks, (nic_event_callback_t)arg);
+        }
+        case NIC_IOCTL_REMOVE_RX_BATCH_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_remove_callback(device, &device->rx_batch_callbacks, (nic_event_callback_t)arg);
         }
         case NIC_IOCTL_ADD_TX_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_add_callback(&device->tx_callbacks, (nic_event_callback_t)arg);
+            return __nic_add_callback(device, &device->tx_callbacks, (nic_event_callback_t)arg);
         }
         case NIC_IOCTL_REMOVE_TX_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_remove_callback(&device->tx_callbacks, (nic_event_callback_t)arg);
+            return __nic_remove_callback(device, &device->tx_callbacks, (nic_event_callback_t)arg);
+        }
+        case NIC_IOCTL_ADD_TX_COMPLETION_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_add_callback(device, &device->tx_completion_callbacks, (nic_event_callback_t)arg);
+        }
+        case NIC_IOCTL_REMOVE_TX_COMPLETION_CALLBACK: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            return __nic_remove_callback(device, &device->tx_completion_callbacks, (nic_event_callback_t)arg);
+        }
+        case NIC_IOCTL_SET_TIMER_CALLBACK: {
+            if (!device) {
+                return STATUS_INVALID_PARAM;
+            }
+            __atomic_store_n(&device->timer_callback, (nic_timer_callback_t)arg, __ATOMIC_RELEASE);
+            // Let the tx worker pick it up and compute its first deadline
+            if (device->is_up) {
+                eventfd_write(device->queues[device->tx_queue].event_fd, 1);
+            }
+            return STATUS_OK;
         }
         case NIC_IOCTL_ADD_ERROR_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_add_callback(&device->error_callbacks, (nic_event_callback_t )arg);
+            return __nic_add_callback(device, &device->error_callbacks, (nic_event_callback_t )arg);
         }
         case NIC_IOCTL_REMOVE_ERROR_CALLBACK: {
             if (!device || !arg) {
                 return STATUS_INVALID_PARAM;
             }
-            return __nic_remove_callback(&device->error_callbacks, (nic_event_callback_t)arg);
+            return __nic_remove_callback(device, &device->error_callbacks, (nic_event_callback_t)arg);
         }
         case NIC_IOCTL_SET_PROMISCUOUS_MODE: {
             if (!device || !arg) {
@@ -330,6 +1284,143 @@ status_t nic_ioctl(nic_device_t *device, unsigned int command, void *arg) {
             device->promiscuous_mode = *(unsigned short *)arg;
             return STATUS_OK;
         }
+        case NIC_IOCTL_GET_POOL_STATS: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            nic_pool_get_stats(device->pool, (nic_pool_stats_t *)arg);
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_GET_RX_QUEUE_STATS: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            nic_rx_queue_stats_t *rx_stats = (nic_rx_queue_stats_t *)arg;
+            rx_stats->capacity = device->rx_ring->mask + 1;
+            rx_stats->depth = __nic_ring_count(device->rx_ring);
+            rx_stats->high_watermark = __atomic_load_n(&device->rx_high_watermark, __ATOMIC_RELAXED);
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_SET_POLL_MODE: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            nic_poll_params_t *poll = (nic_poll_params_t *)arg;
+            if (poll->mode != NIC_POLL_BLOCKING && poll->mode != NIC_POLL_ADAPTIVE) {
+                return STATUS_INVALID_PARAM;
+            }
+            __atomic_store_n(&device->config.poll.busy_poll_usecs, poll->busy_poll_usecs, __ATOMIC_RELAXED);
+            __atomic_store_n(&device->config.poll.idle_usecs, poll->idle_usecs, __ATOMIC_RELAXED);
+            __atomic_store_n(&device->config.poll.mode, poll->mode, __ATOMIC_RELAXED);
+            __nic_apply_poll_mode(device);
+            //Wake the workers so they pick the new mode up now
+            for (unsigned int i = 0; i < device->num_workers; i++) {
+                eventfd_write(device->queues[i].event_fd, 1);
+            }
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_SET_RX_BUDGET: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            __atomic_store_n(&device->config.rx_budget, *(unsigned int *)arg, __ATOMIC_RELAXED);
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_SET_COALESCE: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            nic_coalesce_t *coalesce = (nic_coalesce_t *)arg;
+            __atomic_store_n(&device->config.coalesce.max_frames, coalesce->max_frames, __ATOMIC_RELAXED);
+            __atomic_store_n(&device->config.coalesce.max_usecs, coalesce->max_usecs, __ATOMIC_RELAXED);
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_SET_AFFINITY: {
+            if (!device || !arg || device->num_workers == 0) {
+                return STATUS_INVALID_PARAM;
+            }
+            nic_affinity_t *affinity = (nic_affinity_t *)arg;
+            unsigned int first = affinity->queue, last = affinity->queue;
+            if (affinity->queue == NIC_ALL_QUEUES) {
+                first = 0;
+                last = device->num_workers - 1;
+            } else if (affinity->queue >= device->num_workers) {
+                return STATUS_INVALID_PARAM;
+            }
+            // An empty set unpins the worker
+            int pinned = 0;
+            for (unsigned int i = 0; i < NIC_MAX_CPUS / 64; i++) {
+                pinned |= affinity->cpus.bits[i] != 0;
+            }
+            for (unsigned int i = first; i <= last; i++) {
+                nic_queue_t *queue = &device->queues[i];
+                nic_cpu_mask_t previous = queue->cpus;
+                int was_pinned = queue->pinned;
+                queue->cpus = affinity->cpus;
+                queue->pinned = pinned;
+                if (device->is_up && __nic_apply_affinity(queue, queue->thread) != STATUS_OK) {
+                    queue->cpus = previous;
+                    queue->pinned = was_pinned;
+                    return STATUS_INVALID_PARAM; // No usable CPU in the set
+                }
+            }
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_SET_SCHED: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            nic_sched_t *sched = (nic_sched_t *)arg;
+            if ((sched->policy != SCHED_OTHER && sched->policy != SCHED_FIFO) ||
+                sched->priority < sched_get_priority_min(sched->policy) ||
+                sched->priority > sched_get_priority_max(sched->policy)) {
+                return STATUS_INVALID_PARAM;
+            }
+            if (device->is_up) {
+                for (unsigned int i = 0; i < device->num_workers; i++) {
+                    if (__nic_apply_sched(device->queues[i].thread, sched) != STATUS_OK) {
+                        // Put the workers already switched back where they were
+                        while (i-- > 0) {
+                            __nic_apply_sched(device->queues[i].thread, &device->sched);
+                        }
+                        return STATUS_ERROR;
+                    }
+                }
+            }
+            device->sched = *sched;
+            return STATUS_OK;
+        }
+        case NIC_IOCTL_GET_PLACEMENT: {
+            if (!device || !arg) {
+                return STATUS_INVALID_PARAM;
+            }
+            nic_placement_t *placement = (nic_placement_t *)arg;
+            memset(placement, 0, sizeof(nic_placement_t));
+            placement->num_queues = device->num_workers;
+            for (unsigned int i = 0; i < device->num_workers; i++) {
+                nic_queue_t *queue = &device->queues[i];
+                nic_queue_placement_t *out = &placement->queues[i];
+                out->cpu = -1;
+                out->policy = device->sched.policy;
+                out->priority = device->sched.priority;
+                out->cpus = queue->cpus;
+                if (!device->is_up) {
+                    continue;
+                }
+                // Ask the kernel what is in effect rather than echo the request
+                cpu_set_t set;
+                struct sched_param param;
+                if (pthread_getaffinity_np(queue->thread, sizeof(set), &set) == 0) {
+                    __nic_from_cpuset(&set, &out->cpus);
+                }
+                if (pthread_getschedparam(queue->thread, &out->policy, &param) == 0) {
+                    out->priority = param.sched_priority;
+                }
+                out->tid = queue->tid;
+                out->cpu = __nic_last_cpu(queue->tid);
+            }
+            return STATUS_OK;
+        }
         case NIC_IOCTL_UP: {
             if (!device) {
                 return STATUS_INVALID_PARAM;
@@ -347,37 +1438,65 @@ status_t nic_ioctl(nic_device_t *device, unsigned int command, void *arg) {
     }
 }
         
-status_t nic_send_packet(nic_device_t *device, const void *data, unsigned int length) {
-    // Send a packet through the NIC by writing to the tx buffer
-    if (!device || !data || length == 0 || length > device->mtu+NIC_EXTRA_SIZE) {
+nic_packet_t * nic_alloc_packet(nic_device_t *device) {
+    if (!device || !device->pool) {
+        return NULL;
+    }
+    nic_packet_t *pkt = nic_packet_alloc(device->pool, NIC_PKT_HEADROOM);
+    if (!pkt) {
+        NIC_STATS_ADD(device, tx_dropped_nobuf, 1);
+    }
+    return pkt;
+}
+
+status_t nic_send_pkt(nic_device_t *device, nic_packet_t *pkt) {
+    // Queue a packet for transmission without copying it, the NIC owns it from now on
+    if (!pkt) {
         return STATUS_INVALID_PARAM;
     }
+    if (!device || pkt->len == 0 || pkt->len > device->mtu+NIC_EXTRA_SIZE) {
+        nic_packet_release(pkt);
+        return STATUS_INVALID_PARAM;
+    }
+    // O(1) from any thread, the ring is bounded so a full ring drops the frame
+    if (!__nic_ring_push(device->tx_ring, pkt, pkt->len)) {
+        nic_packet_release(pkt);
+        NIC_STATS_ADD(device, tx_dropped, 1);
+        return STATUS_QUEUE_FULL;
+    }
+    __nic_kick(device);
 
-    nic_buffer_t *new_tx_buffer = (nic_buffer_t *)malloc(sizeof(nic_buffer_t));
-    if (!new_tx_buffer) {
-        return STATUS_ERROR;
+    return STATUS_OK;
+}
+
+status_t nic_send_pkt_async(nic_device_t *device, nic_packet_t *pkt, void *cookie) {
+    // Tag the packet, the tx queue reports its cookie once the frame is out
+    if (!pkt) {
+        return STATUS_INVALID_PARAM;
     }
+    pkt->cookie = cookie;
+    pkt->flags |= NIC_PKT_F_NOTIFY;
+    return nic_send_pkt(device, pkt);
+}
 
-    new_tx_buffer->data = malloc(length);
-    if (!new_tx_buffer->data) {
-        free(new_tx_buffer);
+status_t nic_send_packet(nic_device_t *device, const void *data, unsigned int length) {
+    // Send a packet through the NIC by writing to the tx ring
+    if (!device || !data || length == 0 || length > device->mtu+NIC_EXTRA_SIZE) {
+        return STATUS_INVALID_PARAM;
+    }
+
+    nic_packet_t *pkt = nic_packet_alloc(device->pool, 0);
+    if (!pkt) {
+        NIC_STATS_ADD(device, tx_dropped_nobuf, 1);
         return STATUS_ERROR;
     }
-    memcpy(new_tx_buffer->data, data, length);
-    new_tx_buffer->length = length;
-    new_tx_buffer->next = NULL;
-    // Append to the end of the tx buffer list
-    if (!device->tx_buffer) {
-        device->tx_buffer = new_tx_buffer;
-    } else {
-        nic_buffer_t *tx_buf = device->tx_buffer;
-        while (tx_buf->next) {
-            tx_buf = tx_buf->next;
-        }
-        tx_buf->next = new_tx_buffer;
+    unsigned char *tx_data = nic_packet_append(pkt, length);
+    if (!tx_data) {
+        nic_packet_release(pkt);
+        return STATUS_INVALID_PARAM;
     }
-
-    return STATUS_OK;
+    memcpy(tx_data, data, length);
+    return nic_send_pkt(device, pkt);
 }
 
 status_t nic_receive_packet(nic_device_t *device, void *buffer, unsigned int buffer_length) {
@@ -386,22 +1505,31 @@ status_t nic_receive_packet(nic_device_t *device, void *buffer, unsigned int buf
         return STATUS_INVALID_PARAM;
     }
 
-    if (!device->rx_buffer) {
-        return STATUS_NOT_SUPPORTED; // No packets available
+    // A frame that did not fit last time stays pending for the next call
+    pthread_mutex_lock(&device->rx_lock);
+    if (!device->rx_pending) {
+        void *rx_pkt;
+        unsigned int rx_length;
+        if (!__nic_ring_pop(device->rx_ring, &rx_pkt, &rx_length)) {
+            pthread_mutex_unlock(&device->rx_lock);
+            return STATUS_NOT_SUPPORTED; // No packets available
+        }
+        device->rx_pending = (nic_packet_t *)rx_pkt;
     }
 
-    nic_buffer_t *rx_buf = device->rx_buffer;
-    if (rx_buf->length > buffer_length) {
+    nic_packet_t *rx_buf = device->rx_pending;
+    if (rx_buf->len > buffer_length) {
+        pthread_mutex_unlock(&device->rx_lock);
         return STATUS_INVALID_PARAM; // Buffer too small
     }
 
-    memcpy(buffer, rx_buf->data, rx_buf->length);
-    unsigned int received_length = rx_buf->length;
+    // Take the frame out of the rx queue
+    device->rx_pending = NULL;
+    pthread_mutex_unlock(&device->rx_lock);
 
-    // Remove the buffer from the rx list
-    device->rx_buffer = rx_buf->next;
-    free(rx_buf->data);
-    free(rx_buf);
+    memcpy(buffer, nic_packet_data(rx_buf), rx_buf->len);
+    unsigned int received_length = rx_buf->len;
+    nic_packet_release(rx_buf);
 
     return received_length;
 }
@@ -411,6 +1539,9 @@ nic_driver_t nic_driver = {
     .shutdown = nic_shutdown,
     .send_packet = nic_send_packet,
     .receive_packet = nic_receive_packet,
+    .alloc_packet = nic_alloc_packet,
+    .send_pkt = nic_send_pkt,
+    .send_pkt_async = nic_send_pkt_async,
     .ioctl = nic_ioctl
 };
 
@@ -4,36 +4,30 @@
 #include "icmp.h"
 #include "tcp.h"
 #include "dhcp.h"
+#include "checksum.h"
+#include "log.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <arpa/inet.h>
 
-static uint16_t checksum(void *data, int len)
+/* Contador por protocolo de transporte, -1 si no lo llevamos */
+static int ipv4_proto_index(uint8_t proto)
 {
-    uint16_t *buf = data;
-    uint32_t sum = 0;
-
-    while (len > 1) {
-        sum += *buf++;
-        len -= 2;
+    switch (proto) {
+        case IPV4_PROTO_ICMP: return NIC_PROTO_ICMP;
+        case IPV4_PROTO_TCP:  return NIC_PROTO_TCP;
+        case IPV4_PROTO_UDP:  return NIC_PROTO_UDP;
+        default:              return -1;
     }
-    if (len)
-        sum += *(uint8_t *)buf;
-
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-
-    return (uint16_t)(~sum);
 }
 
 int ipv4_send(device_handle *dev, nic_driver_t *drv, uint32_t dst, uint8_t proto,
-              const uint8_t *payload, uint16_t payload_len)
+              nic_packet_t *pkt)
 {
-    uint8_t buffer[2048];
-    ethernet_frame *frame = (ethernet_frame *)buffer;
     uint8_t dst_ip[4];
     uint8_t dst_mac[6];
+    uint16_t payload_len = pkt->len;
 
     /* Convertir dst a array para ARP lookup */
     dst_ip[0] = (dst >> 24) & 0xFF;
@@ -41,35 +35,22 @@ int ipv4_send(device_handle *dev, nic_driver_t *drv, uint32_t dst, uint8_t proto
     dst_ip[2] = (dst >> 8)  & 0xFF;
     dst_ip[3] = dst & 0xFF;
 
-    /* Broadcast: no ARP, MAC FF:FF:FF:FF:FF:FF (DHCP, etc.) */
-    if (dst == 0xFFFFFFFF) {
-        memset(dst_mac, 0xFF, 6);
-    } else {
-        /* Buscar MAC en caché ARP */
-        if (arp_lookup(dst_ip, dst_mac) != 0) {
-            printf("IPv4: ARP lookup failed for %d.%d.%d.%d, sending ARP request...\n",
-                   dst_ip[0], dst_ip[1], dst_ip[2], dst_ip[3]);
-
-            /* Enviar ARP request y devolver error (el llamador debe reintentar) */
-            uint8_t arp_buf[sizeof(arp_packet)];
-            unsigned int arp_len = arp_build_request(arp_buf, dev, dst_ip);
-
-            ethernet_frame *arp_frame = (ethernet_frame *)buffer;
-            memset(arp_frame->dest_mac, 0xFF, 6);
-            memcpy(arp_frame->src_mac, dev->mac, 6);
-            arp_frame->ethertype = htons(ethtype_ARP);
-            memcpy(arp_frame->payload, arp_buf, arp_len);
-
-            ethernet_send(drv, (nic_device_t *)dev, arp_frame, ETH_HEADER_LEN + arp_len);
-            return -1;  /* Necesita reintentar después de recibir ARP reply */
-        }
+    /* Origen: la direccion propia en la VLAN del paquete */
+    const uint8_t *my_ip = eth_local_ip(dev, pkt->vlan_id);
+    if (!my_ip) {
+        nic_packet_release(pkt);
+        return -1;
     }
 
-    /* Construir IP header en payload del frame */
-    ipv4_hdr_t *hdr = (ipv4_hdr_t *)frame->payload;
+    /* Anteponer el IP header al payload, en el mismo buffer */
+    ipv4_hdr_t *hdr = (ipv4_hdr_t *)nic_packet_prepend(pkt, IPV4_HEADER_LEN);
+    if (!hdr) {
+        nic_packet_release(pkt);
+        return -1;
+    }
 
-    uint32_t src = (dev->ip[0] << 24) | (dev->ip[1] << 16) |
-                   (dev->ip[2] << 8)  | dev->ip[3];
+    uint32_t src = (my_ip[0] << 24) | (my_ip[1] << 16) |
+                   (my_ip[2] << 8)  | my_ip[3];
 
     hdr->ver_ihl   = (IPV4_VERSION << 4) | 5;
     hdr->tos       = 0;
@@ -82,57 +63,145 @@ int ipv4_send(device_handle *dev, nic_driver_t *drv, uint32_t dst, uint8_t proto
     hdr->src       = htonl(src);
     hdr->dst       = htonl(dst);
 
-    hdr->checksum = checksum(hdr, IPV4_HEADER_LEN);
-    memcpy(frame->payload + IPV4_HEADER_LEN, payload, payload_len);
+    hdr->checksum = csum(hdr, IPV4_HEADER_LEN);
 
-    /* Usar MAC de caché ARP o broadcast */
-    memcpy(frame->dest_mac, dst_mac, 6);
-    memcpy(frame->src_mac, dev->mac, 6);
-    frame->ethertype = htons(ethtype_IPv4);
+    int proto_index = ipv4_proto_index(proto);
+    if (proto_index >= 0)
+        NIC_STATS_ADD((nic_device_t *)dev->owner, tx_proto[proto_index], 1);
 
-    unsigned int total_len = ETH_HEADER_LEN + IPV4_HEADER_LEN + payload_len;
+    /* Broadcast: no ARP, MAC FF:FF:FF:FF:FF:FF (DHCP, etc.) */
+    if (dst == 0xFFFFFFFF) {
+        memset(dst_mac, 0xFF, 6);
+    } else {
+        /* Buscar MAC en caché ARP */
+        int neighbor = arp_lookup(dst_ip, dst_mac);
+        if (neighbor == ARP_LOOKUP_STALE) {
+            /* Se envia igual, la respuesta renovara la entrada */
+            arp_send_request(dev, drv, pkt, my_ip, dst_ip, dst_mac);
+        } else if (neighbor != ARP_LOOKUP_REACHABLE) {
+            NIC_LOG_DEBUG(NIC_LOG_IPV4, "ARP lookup failed for %d.%d.%d.%d, holding packet",
+                   dst_ip[0], dst_ip[1], dst_ip[2], dst_ip[3]);
+            /* Sale en cuanto llegue la respuesta ARP */
+            return arp_hold_packet(dev, drv, dst_ip, my_ip, pkt);
+        }
+    }
 
-    return ethernet_send(drv, (nic_device_t *)dev, frame, total_len);
+    /* Usar MAC de caché ARP o broadcast */
+    return ethernet_send(drv, dev, pkt, dst_mac, ethtype_IPv4);
 }
 
-void ipv4_handler(uint8_t *packet, int len, device_handle *dev, nic_driver_t *drv)
+/* Motivo de descarte de ipv4_validate */
+enum {
+    IPV4_VALID = 0,
+    IPV4_SHORT,
+    IPV4_BAD_HEADER,
+    IPV4_BAD_CHECKSUM,
+    IPV4_FRAGMENT,
+};
+
+/* Una sola pasada sobre la cabecera antes de gastar nada mas en el paquete.
+   Devuelve IPV4_VALID con la longitud de cabecera (IHL) y la total */
+static inline int ipv4_validate(const nic_packet_t *pkt, unsigned int *hdr_len,
+                                unsigned int *total_len)
 {
-    (void)drv;
+    if (pkt->len < IPV4_HEADER_LEN)
+        return IPV4_SHORT;
+
+    const ipv4_hdr_t *hdr = (const ipv4_hdr_t *)nic_packet_data(pkt);
+    unsigned int ihl = hdr->ver_ihl & 0x0F;
+    if ((hdr->ver_ihl >> 4) != IPV4_VERSION || ihl < IPV4_HEADER_LEN / 4)
+        return IPV4_BAD_HEADER;
+    if (ihl * 4 > pkt->len)
+        return IPV4_SHORT;
+
+    /* total_len manda: lo que sobre de la trama es relleno Ethernet */
+    unsigned int total = ntohs(hdr->total_len);
+    if (total < ihl * 4)
+        return IPV4_BAD_HEADER;
+    if (total > pkt->len)
+        return IPV4_SHORT;
+
+    /* Un header bien formado suma 0 incluyendo su propio checksum */
+    if (!csum_verify_ipv4(hdr, ihl))
+        return IPV4_BAD_CHECKSUM;
+
+    /* Sin reensamblado: un fragmento no se puede entregar a nadie */
+    if (ntohs(hdr->flags_frag) & (IPV4_FLAG_MF | IPV4_FRAG_MASK))
+        return IPV4_FRAGMENT;
+
+    *hdr_len = ihl * 4;
+    *total_len = total;
+    return IPV4_VALID;
+}
 
-    if (len < IPV4_HEADER_LEN)
-        return;
+void ipv4_handler(nic_packet_t *pkt, device_handle *dev, nic_driver_t *drv)
+{
+    nic_device_t *nic = (nic_device_t *)dev->owner;
 
-    ipv4_hdr_t *hdr = (ipv4_hdr_t *)packet;
-    if ((hdr->ver_ihl >> 4) != IPV4_VERSION)
-        return;
+    unsigned int hdr_len, total_len;
+    switch (ipv4_validate(pkt, &hdr_len, &total_len)) {
+        case IPV4_VALID:
+            break;
+        case IPV4_SHORT:
+            NIC_STATS_ADD(nic, rx_dropped_short, 1);
+            return;
+        case IPV4_BAD_HEADER:
+            NIC_STATS_ADD(nic, rx_dropped_bad_header, 1);
+            return;
+        case IPV4_BAD_CHECKSUM:
+            NIC_STATS_ADD(nic, rx_dropped_bad_checksum, 1);
+            return;
+        default:
+            NIC_STATS_ADD(nic, rx_dropped_fragment, 1);
+            return;
+    }
+
+    ipv4_hdr_t *hdr = (ipv4_hdr_t *)nic_packet_data(pkt);
 
     uint32_t src_ip = ntohl(hdr->src);
     uint32_t dst_ip = ntohl(hdr->dst);
 
-    /* Aquí podrías actualizar caché ARP con la IP origen si tuvieras la MAC del frame */
+    /* Quien nos habla sigue vivo: confirmar su entrada ARP si ya la tenemos */
+    arp_refresh((const uint8_t *)&hdr->src, eth_src_mac(pkt));
 
-    uint32_t my_ip = (dev->ip[0] << 24) | (dev->ip[1] << 16) |
-                     (dev->ip[2] << 8)  | dev->ip[3];
+    /* eth_classify ya descarto las VLAN sin direccion */
+    const uint8_t *local = eth_local_ip(dev, pkt->vlan_id);
+    if (!local) {
+        NIC_STATS_ADD(nic, rx_dropped_not_for_me, 1);
+        return;
+    }
+    uint32_t my_ip = (local[0] << 24) | (local[1] << 16) |
+                     (local[2] << 8)  | local[3];
 
     /* Aceptar paquetes dirigidos a nosotros o a broadcast (para DHCP) */
     uint32_t broadcast_ip = 0xFFFFFFFF;
-    if (dst_ip != my_ip && dst_ip != broadcast_ip)
+    if (dst_ip != my_ip && dst_ip != broadcast_ip) {
+        NIC_STATS_ADD(nic, rx_dropped_not_for_me, 1);
         return;
+    }
 
-    uint8_t *payload = packet + IPV4_HEADER_LEN;
-    int payload_len  = ntohs(hdr->total_len) - IPV4_HEADER_LEN;
+    /* Quitar el relleno Ethernet y la cabecera IP con sus opciones; los
+       manejadores de L4 tienen la cabecera en nic_packet_l3 y su segmento en l4 */
+    pkt->l3_off = pkt->data_off;
+    nic_packet_trim(pkt, total_len);
+    nic_packet_pull(pkt, hdr_len);
+    pkt->l4_off = pkt->data_off;
+
+    int proto_index = ipv4_proto_index(hdr->protocol);
+    if (proto_index >= 0)
+        NIC_STATS_ADD(nic, rx_proto[proto_index], 1);
 
     switch (hdr->protocol) {
         case IPV4_PROTO_ICMP:
-            icmp_handler(payload, payload_len, dev, drv, src_ip);
+            icmp_handler(pkt, dev, drv, src_ip);
             break;
         case IPV4_PROTO_TCP:
-            tcp_handler(payload, payload_len, dev, drv, src_ip, dst_ip);
+            tcp_handler(pkt, dev, drv, src_ip, dst_ip);
             break;
         case IPV4_PROTO_UDP:
-            dhcp_handle_udp(payload, payload_len, dev);
+            dhcp_handle_udp(nic_packet_data(pkt), pkt->len, dev);
             break;
         default:
             break;
     }
-}
\ No newline at end of file
+}
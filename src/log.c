@@ -0,0 +1,336 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+// Records of one thread. The owner is the only producer, the log thread the
+// only consumer, so head and tail just need acquire/release ordering.
+typedef struct nic_log_ring {
+    unsigned long head __attribute__((aligned(64)));   // Next slot to fill
+    unsigned long tail_cache;                           // Owner's last view of tail
+    unsigned long dropped;
+    unsigned long tail __attribute__((aligned(64)));   // Next slot to format
+    unsigned long reported;                             // Drops already announced
+    int closed;                                         // Owner exited, freed once drained
+    struct nic_log_ring *next;
+    nic_log_record_t records[NIC_LOG_RING_SIZE];
+} nic_log_ring_t;
+
+unsigned char __nic_log_levels[NIC_LOG_MODULE_COUNT] = {
+    [0 ... NIC_LOG_MODULE_COUNT - 1] = NIC_LOG_LEVEL_INFO
+};
+
+static const char *module_names[NIC_LOG_MODULE_COUNT] = {
+    "nic", "eth", "arp", "ipv4", "icmp", "tcp", "http", "dhcp", "app"
+};
+static const char level_tags[] = "DIWE";
+
+static __thread nic_log_ring_t *thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// Guards the ring list and the log thread, also serializes consumers
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static nic_log_ring_t *rings;
+static unsigned long retired_dropped;
+static pthread_t log_thread;
+static int log_running;
+static int log_stop;
+static FILE *log_output;
+
+static void __nic_log_ring_exit(void *arg) {
+    nic_log_ring_t *ring = (nic_log_ring_t *)arg;
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void __nic_log_make_key(void) {
+    pthread_key_create(&ring_key, __nic_log_ring_exit);
+}
+
+// Copy one conversion into line with the argument cast back to what the format expects
+static int __nic_log_convert(char *line, size_t room, const char *spec, const char *length,
+                             char conv, const nic_log_record_t *record, unsigned int arg) {
+    char format[40];
+    long long value = (long long)record->args[arg].u;
+    switch (conv) {
+        case 'd':
+        case 'i':
+            if (!strcmp(length, "hh")) value = (signed char)value;
+            else if (!strcmp(length, "h")) value = (short)value;
+            else if (!length[0]) value = (int)value;
+            else if (!strcmp(length, "l")) value = (long)value;
+            snprintf(format, sizeof(format), "%sll%c", spec, conv);
+            return snprintf(line, room, format, value);
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o': {
+            unsigned long long uvalue = record->args[arg].u;
+            if (!strcmp(length, "hh")) uvalue = (unsigned char)uvalue;
+            else if (!strcmp(length, "h")) uvalue = (unsigned short)uvalue;
+            else if (!length[0]) uvalue = (unsigned int)uvalue;
+            else if (!strcmp(length, "l")) uvalue = (unsigned long)uvalue;
+            snprintf(format, sizeof(format), "%sll%c", spec, conv);
+            return snprintf(line, room, format, uvalue);
+        }
+        case 'c':
+            snprintf(format, sizeof(format), "%sc", spec);
+            return snprintf(line, room, format, (int)value);
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            snprintf(format, sizeof(format), "%s%c", spec, conv);
+            return snprintf(line, room, format, record->types[arg] == __NIC_LOG_DOUBLE ?
+                            record->args[arg].d : (double)value);
+        case 's':
+            snprintf(format, sizeof(format), "%ss", spec);
+            if (record->types[arg] == __NIC_LOG_STR) {
+                return snprintf(line, room, format, record->data + record->args[arg].u);
+            }
+            return snprintf(line, room, format, record->types[arg] == __NIC_LOG_PTR ?
+                            (const char *)record->args[arg].p : "?");
+        case 'p':
+            snprintf(format, sizeof(format), "%sp", spec);
+            return snprintf(line, room, format, record->args[arg].p);
+        default:
+            return 0;
+    }
+}
+
+static void __nic_log_format(FILE *output, const nic_log_record_t *record) {
+    char line[1024];
+    time_t seconds = (time_t)(record->tstamp / 1000000000ULL);
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    int position = snprintf(line, sizeof(line), "%02d:%02d:%02d.%06llu %c %-4s ",
+                            tm.tm_hour, tm.tm_min, tm.tm_sec,
+                            (record->tstamp % 1000000000ULL) / 1000,
+                            level_tags[record->level], module_names[record->module]);
+    size_t pos = (size_t)position;
+    unsigned int arg = 0;
+    const char *f = record->fmt;
+    while (*f && pos < sizeof(line) - 1) {
+        if (*f != '%') {
+            line[pos++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            line[pos++] = '%';
+            f += 2;
+            continue;
+        }
+        // Flags, width and precision are kept, the length modifier is handled apart
+        char spec[24];
+        char length[3] = "";
+        size_t n = 0, l = 0;
+        spec[n++] = *f++;
+        while (*f && strchr("-+ #0123456789.", *f) && n < sizeof(spec) - 1) {
+            spec[n++] = *f++;
+        }
+        while (*f && strchr("hlLqjzt", *f)) {
+            if (l < sizeof(length) - 1) {
+                length[l++] = *f;
+            }
+            f++;
+        }
+        length[l] = '\0';
+        spec[n] = '\0';
+        if (!*f || arg >= record->nargs) {
+            break;
+        }
+        int written = __nic_log_convert(line + pos, sizeof(line) - pos, spec, length, *f++, record, arg++);
+        if (written > 0) {
+            pos += (size_t)written < sizeof(line) - pos ? (size_t)written : sizeof(line) - pos - 1;
+        }
+    }
+    // Call sites leave the line break to the log
+    while (pos > 0 && line[pos - 1] == '\n') {
+        pos--;
+    }
+    line[pos++] = '\n';
+    fwrite(line, 1, pos, output);
+}
+
+// Format everything committed so far, returns the records written
+static unsigned int __nic_log_drain(void) {
+    unsigned int written = 0;
+    pthread_mutex_lock(&log_lock);
+    FILE *output = log_output ? log_output : stdout;
+    nic_log_ring_t **link = &rings;
+    while (*link) {
+        nic_log_ring_t *ring = *link;
+        // Read closed first, the owner committed its last record before setting it
+        int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (unsigned long tail = ring->tail; tail != head; tail++) {
+            __nic_log_format(output, &ring->records[tail & (NIC_LOG_RING_SIZE - 1)]);
+            // Hand the slot back at once so a busy producer can reuse it
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+            written++;
+        }
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            fprintf(output, "log: %lu records dropped, ring full\n", dropped - ring->reported);
+            ring->reported = dropped;
+            written++;
+        }
+        if (closed) {
+            *link = ring->next;
+            retired_dropped += dropped;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    if (written) {
+        fflush(output);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return written;
+}
+
+static void * __nic_log_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        int stop = __atomic_load_n(&log_stop, __ATOMIC_ACQUIRE);
+        if (__nic_log_drain() == 0) {
+            if (stop) {
+                break;
+            }
+            struct timespec idle = { 0, NIC_LOG_FLUSH_USECS * 1000L };
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void __nic_log_start(void) {
+    pthread_mutex_lock(&log_lock);
+    if (!log_running) {
+        log_stop = 0;
+        if (pthread_create(&log_thread, NULL, __nic_log_thread, NULL) == 0) {
+            __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+static nic_log_ring_t * __nic_log_attach(void) {
+    pthread_once(&ring_key_once, __nic_log_make_key);
+    nic_log_ring_t *ring;
+    if (posix_memalign((void **)&ring, 64, sizeof(nic_log_ring_t)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, offsetof(nic_log_ring_t, records));
+    pthread_setspecific(ring_key, ring);
+    pthread_mutex_lock(&log_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&log_lock);
+    thread_ring = ring;
+    return ring;
+}
+
+nic_log_record_t * __nic_log_begin(int level, nic_log_module_t module) {
+    nic_log_ring_t *ring = thread_ring;
+    if (__builtin_expect(!ring, 0) && !(ring = __nic_log_attach())) {
+        return NULL;
+    }
+    if (__builtin_expect(!__atomic_load_n(&log_running, __ATOMIC_RELAXED), 0)) {
+        __nic_log_start();
+    }
+    unsigned long head = ring->head;
+    if (head - ring->tail_cache >= NIC_LOG_RING_SIZE) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->tail_cache >= NIC_LOG_RING_SIZE) {
+            // Never wait for the log thread, losing a message beats stalling the data path
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    nic_log_record_t *record = &ring->records[head & (NIC_LOG_RING_SIZE - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->tstamp = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->level = (unsigned char)level;
+    record->module = (unsigned char)module;
+    record->nargs = 0;
+    record->used = 0;
+    return record;
+}
+
+void __nic_log_commit(nic_log_record_t *record) {
+    (void)record;
+    nic_log_ring_t *ring = thread_ring;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void __nic_log_str(nic_log_record_t *record, const char *value) {
+    size_t room = sizeof(record->data) - record->used;
+    if (!value || room == 0) {
+        __nic_log_ptr(record, value ? "" : "(null)");
+        return;
+    }
+    if (record->nargs >= NIC_LOG_MAX_ARGS) {
+        return;
+    }
+    size_t length = strnlen(value, room - 1);
+    memcpy(record->data + record->used, value, length);
+    record->data[record->used + length] = '\0';
+    record->types[record->nargs] = __NIC_LOG_STR;
+    record->args[record->nargs++].u = record->used;
+    record->used += (unsigned char)(length + 1);
+}
+
+void nic_log_set_level(nic_log_module_t module, int level) {
+    if ((unsigned int)module < NIC_LOG_MODULE_COUNT) {
+        __atomic_store_n(&__nic_log_levels[module], (unsigned char)level, __ATOMIC_RELAXED);
+    }
+}
+
+int nic_log_get_level(nic_log_module_t module) {
+    if ((unsigned int)module >= NIC_LOG_MODULE_COUNT) {
+        return -1;
+    }
+    return __atomic_load_n(&__nic_log_levels[module], __ATOMIC_RELAXED);
+}
+
+void nic_log_set_output(FILE *output) {
+    pthread_mutex_lock(&log_lock);
+    log_output = output;
+    pthread_mutex_unlock(&log_lock);
+}
+
+void nic_log_flush(void) {
+    __nic_log_drain();
+}
+
+void nic_log_shutdown(void) {
+    pthread_mutex_lock(&log_lock);
+    int running = log_running;
+    __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&log_lock);
+    if (running) {
+        pthread_join(log_thread, NULL);
+        __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    }
+    __nic_log_drain();
+}
+
+unsigned long nic_log_dropped(void) {
+    pthread_mutex_lock(&log_lock);
+    unsigned long dropped = retired_dropped;
+    for (nic_log_ring_t *ring = rings; ring; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return dropped;
+}
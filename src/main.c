@@ -8,17 +8,22 @@
 #include "ethernet.h"
 #include "commons.h"
 #include "dhcp.h"
+#include "arp.h"
+#include "log.h"
 
 char interface_name[MAX_INTERFACE_NAME];
 
 nic_device_t nic;
 nic_driver_t * drv;
 
-void on_receive_packet(const void *data, unsigned int length) {
+void on_receive_batch(nic_packet_t *pkts, unsigned int count) {
     struct device_handle *dev = (struct device_handle *)nic.hw_handle;
     
-    printf("\nRX: %u bytes on %s\n", length, dev->name);
-    ethernet_handle(data, length, dev, drv);
+    for (unsigned int i = 0; i < count; i++) {
+        NIC_LOG_DEBUG(NIC_LOG_APP, "RX: %u bytes on %s", pkts[i].len, dev->name);
+    }
+    // Frames of one ethertype go up the stack together
+    ethernet_handle_batch(pkts, count, dev, drv);
 }
 
 int main(int argc, char* argv[]) {
@@ -29,18 +34,23 @@ int main(int argc, char* argv[]) {
     strncpy(interface_name, argv[1], MAX_INTERFACE_NAME - 1);
 
     drv = nic_get_driver();
+    // Frames are handled in the callback, nothing reads the rx queue
+    nic.config.rx_overflow = NIC_RX_CALLBACKS_ONLY;
 
     if (drv->init(&nic) != STATUS_OK) {
         printf("Failed to initialize NIC\n");
         return -1;
     }
-    if (drv->ioctl(&nic, NIC_IOCTL_ADD_RX_CALLBACK, (void *)&on_receive_packet) != STATUS_OK) {
+    if (drv->ioctl(&nic, NIC_IOCTL_ADD_RX_BATCH_CALLBACK, (void *)&on_receive_batch) != STATUS_OK) {
         printf("[MAIN] Starting DHCP client...\n");//Ivan
         dhcp_start((struct device_handle *)nic.hw_handle);//Ivan
         drv->shutdown(&nic);
         return -1;
     }
 
+    // ARP retransmits and gives up on unanswered neighbors even on a quiet link
+    drv->ioctl(&nic, NIC_IOCTL_SET_TIMER_CALLBACK, (void *)&arp_pending_tick);
+
     ethernet_frame test_eth;
     unsigned int packet_length = eth_build_frame(
         &test_eth,
@@ -61,9 +71,30 @@ int main(int argc, char* argv[]) {
     printf("Press Enter to exit...\n");
     getchar();
 
+    nic_stats_t stats;
+    if (drv->ioctl(&nic, NIC_IOCTL_GET_STATS, &stats) == STATUS_OK) {
+        printf("RX %lu packets / %lu bytes, TX %lu packets / %lu bytes\n",
+               stats.rx_packets, stats.rx_bytes, stats.tx_packets, stats.tx_bytes);
+        printf("RX drops: short %lu, not for me %lu, bad checksum %lu, unknown ethertype %lu, vlan %lu\n",
+               stats.rx_dropped_short, stats.rx_dropped_not_for_me,
+               stats.rx_dropped_bad_checksum, stats.rx_dropped_unknown_ethertype,
+               stats.rx_dropped_vlan);
+        printf("IPv4 drops: bad header %lu, fragment %lu\n",
+               stats.rx_dropped_bad_header, stats.rx_dropped_fragment);
+        printf("TX drops: ring full %lu, no buffer %lu, unresolved neighbor %lu\n",
+               stats.tx_dropped, stats.tx_dropped_nobuf, stats.tx_dropped_unresolved);
+        printf("ARP storm: rx dropped %lu, requests suppressed %lu\n",
+               stats.rx_dropped_arp_storm, stats.tx_arp_suppressed);
+        printf("RX by protocol: ARP %lu, IPv4 %lu, ICMP %lu, TCP %lu, UDP %lu\n",
+               stats.rx_proto[NIC_PROTO_ARP], stats.rx_proto[NIC_PROTO_IPV4],
+               stats.rx_proto[NIC_PROTO_ICMP], stats.rx_proto[NIC_PROTO_TCP],
+               stats.rx_proto[NIC_PROTO_UDP]);
+    }
+
     if (drv->shutdown(&nic) != STATUS_OK) {
         printf("Failed to shutdown NIC\n");
         return -1;
     }
+    nic_log_shutdown();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include <string.h>
+
+#include "packet.h"
+#include "pool.h"
+
+nic_packet_t * nic_packet_alloc(struct nic_pool *pool, unsigned int headroom) {
+    nic_packet_t *pkt = (nic_packet_t *)nic_pool_alloc(pool);
+    if (!pkt) {
+        return NULL;
+    }
+    pkt->pool = pool;
+    pkt->next = NULL;
+    pkt->refcnt = 1;
+    pkt->flags = 0;
+    pkt->head = (unsigned char *)(pkt + 1);
+    pkt->capacity = pool->buffer_size - sizeof(nic_packet_t);
+    pkt->data_off = headroom < pkt->capacity ? headroom : pkt->capacity;
+    pkt->len = 0;
+    pkt->l2_off = pkt->l3_off = pkt->l4_off = pkt->l7_off = 0;
+    pkt->tstamp = 0;
+    pkt->cookie = NULL;
+    pkt->vlan_id = pkt->outer_vlan_id = 0;
+    return pkt;
+}
+
+nic_packet_t * nic_packet_copy(struct nic_pool *pool, const nic_packet_t *src) {
+    nic_packet_t *pkt = nic_packet_alloc(pool, NIC_PKT_HEADROOM);
+    if (!pkt) {
+        return NULL;
+    }
+    unsigned char *data = nic_packet_append(pkt, src->len);
+    if (!data) {
+        nic_packet_release(pkt);
+        return NULL;
+    }
+    memcpy(data, nic_packet_data(src), src->len);
+    // Keep the parsed layers pointing at the same bytes
+    int shift = (int)pkt->data_off - (int)src->data_off;
+    pkt->l2_off = src->l2_off + shift;
+    pkt->l3_off = src->l3_off + shift;
+    pkt->l4_off = src->l4_off + shift;
+    pkt->l7_off = src->l7_off + shift;
+    pkt->tstamp = src->tstamp;
+    pkt->vlan_id = src->vlan_id;
+    pkt->outer_vlan_id = src->outer_vlan_id;
+    return pkt;
+}
+
+void nic_packet_wrap(nic_packet_t *pkt, void *data, unsigned int length) {
+    pkt->pool = NULL;
+    pkt->next = NULL;
+    pkt->refcnt = 1;
+    pkt->flags = NIC_PKT_F_EXTERNAL;
+    pkt->head = (unsigned char *)data;
+    pkt->capacity = length;
+    pkt->data_off = 0;
+    pkt->len = length;
+    pkt->l2_off = pkt->l3_off = pkt->l4_off = pkt->l7_off = 0;
+    pkt->tstamp = 0;
+    pkt->cookie = NULL;
+    pkt->vlan_id = pkt->outer_vlan_id = 0;
+}
+
+void nic_packet_release(nic_packet_t *pkt) {
+    if (!pkt) {
+        return;
+    }
+    if (__atomic_sub_fetch(&pkt->refcnt, 1, __ATOMIC_ACQ_REL) == 0 && pkt->pool) {
+        nic_pool_free(pkt->pool, pkt);
+    }
+}
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+typedef struct nic_pool_cache {
+    nic_pool_t *pool;
+    unsigned int count;
+    void *buffers[NIC_POOL_CACHE_SIZE];
+    struct nic_pool_cache *next;
+} nic_pool_cache_t;
+
+static __thread nic_pool_cache_t thread_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static void __nic_pool_flush(nic_pool_t *pool, nic_pool_cache_t *cache, unsigned int count) {
+    pthread_mutex_lock(&pool->lock);
+    while (count-- > 0 && cache->count > 0) {
+        pool->free_list[pool->free_count++] = cache->buffers[--cache->count];
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void __nic_pool_unbind(nic_pool_cache_t *cache) {
+    nic_pool_t *pool = cache->pool;
+    pthread_mutex_lock(&pool->lock);
+    while (cache->count > 0) {
+        pool->free_list[pool->free_count++] = cache->buffers[--cache->count];
+    }
+    nic_pool_cache_t **link = &pool->caches;
+    while (*link && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = cache->next;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    cache->pool = NULL;
+    cache->next = NULL;
+}
+
+static void __nic_pool_thread_exit(void *arg) {
+    nic_pool_cache_t *cache = (nic_pool_cache_t *)arg;
+    // Hand the cached buffers back so they are not lost with the thread
+    if (cache->pool) {
+        __nic_pool_unbind(cache);
+    }
+}
+
+static void __nic_pool_make_key(void) {
+    pthread_key_create(&cache_key, __nic_pool_thread_exit);
+}
+
+static nic_pool_cache_t * __nic_pool_cache(nic_pool_t *pool) {
+    nic_pool_cache_t *cache = &thread_cache;
+    if (cache->pool == pool) {
+        return cache;
+    }
+    // First use on this thread or the cache belongs to another pool
+    if (cache->pool) {
+        __nic_pool_unbind(cache);
+    }
+    pthread_once(&cache_key_once, __nic_pool_make_key);
+    pthread_setspecific(cache_key, cache);
+    pthread_mutex_lock(&pool->lock);
+    cache->pool = pool;
+    cache->count = 0;
+    cache->next = pool->caches;
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->lock);
+    return cache;
+}
+
+nic_pool_t * nic_pool_create(unsigned int buffer_count, unsigned int buffer_size, int use_hugepages) {
+    if (buffer_count == 0 || buffer_size == 0) {
+        return NULL;
+    }
+    nic_pool_t *pool = (nic_pool_t *)malloc(sizeof(nic_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->buffer_size = (buffer_size + NIC_POOL_ALIGN - 1) & ~(NIC_POOL_ALIGN - 1);
+    pool->buffer_count = buffer_count;
+    pool->memory_size = (size_t)pool->buffer_size * buffer_count;
+    pool->hugepages = 0;
+    pool->memory = MAP_FAILED;
+    if (use_hugepages) {
+        size_t huge_size = (pool->memory_size + NIC_POOL_HUGEPAGE_SIZE - 1) & ~(NIC_POOL_HUGEPAGE_SIZE - 1);
+        pool->memory = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (pool->memory != MAP_FAILED) {
+            pool->memory_size = huge_size;
+            pool->hugepages = 1;
+        }
+    }
+    if (pool->memory == MAP_FAILED) {
+        // No hugepages reserved (or not requested), use regular pages
+        pool->memory = mmap(NULL, pool->memory_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (pool->memory == MAP_FAILED) {
+            free(pool);
+            return NULL;
+        }
+    }
+
+    pool->free_list = (void **)malloc(sizeof(void *) * buffer_count);
+    if (!pool->free_list) {
+        munmap(pool->memory, pool->memory_size);
+        free(pool);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < buffer_count; i++) {
+        pool->free_list[i] = pool->memory + (size_t)(buffer_count - 1 - i) * pool->buffer_size;
+    }
+    pool->free_count = buffer_count;
+    pool->caches = NULL;
+    pool->exhausted = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void nic_pool_destroy(nic_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    // Buffers still sitting in thread caches die with the mapping, detach
+    // those caches so their threads start over on next use
+    pthread_mutex_lock(&pool->lock);
+    nic_pool_cache_t *cache = pool->caches;
+    while (cache) {
+        nic_pool_cache_t *next = cache->next;
+        cache->pool = NULL;
+        cache->count = 0;
+        cache->next = NULL;
+        cache = next;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_destroy(&pool->lock);
+    munmap(pool->memory, pool->memory_size);
+    free(pool->free_list);
+    free(pool);
+}
+
+void * nic_pool_alloc(nic_pool_t *pool) {
+    nic_pool_cache_t *cache = __nic_pool_cache(pool);
+    if (cache->count == 0) {
+        pthread_mutex_lock(&pool->lock);
+        while (cache->count < NIC_POOL_CACHE_BATCH && pool->free_count > 0) {
+            cache->buffers[cache->count++] = pool->free_list[--pool->free_count];
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (cache->count == 0) {
+            __atomic_fetch_add(&pool->exhausted, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    return cache->buffers[--cache->count];
+}
+
+void nic_pool_free(nic_pool_t *pool, void *buffer) {
+    if (!buffer) {
+        return;
+    }
+    nic_pool_cache_t *cache = __nic_pool_cache(pool);
+    if (cache->count == NIC_POOL_CACHE_SIZE) {
+        __nic_pool_flush(pool, cache, NIC_POOL_CACHE_BATCH);
+    }
+    cache->buffers[cache->count++] = buffer;
+}
+
+void nic_pool_get_stats(nic_pool_t *pool, nic_pool_stats_t *stats) {
+    pthread_mutex_lock(&pool->lock);
+    stats->free_buffers = pool->free_count;
+    pthread_mutex_unlock(&pool->lock);
+    stats->buffer_count = pool->buffer_count;
+    stats->buffer_size = pool->buffer_size;
+    stats->hugepages = pool->hugepages;
+    stats->exhausted = __atomic_load_n(&pool->exhausted, __ATOMIC_RELAXED);
+}
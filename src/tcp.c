@@ -1,82 +1,108 @@
 #include "tcp.h"
 #include "ipv4.h"
 #include "http.h"
+#include "ethernet.h"
+#include "checksum.h"
+#include "log.h"
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 
-typedef struct {
-    uint32_t src;
-    uint32_t dst;
-    uint8_t  zero;
-    uint8_t  proto;
-    uint16_t tcp_len;
-} __attribute__((packed)) tcp_pseudo_hdr_t;
-
 static tcp_conn_t conn = {0};
 static uint16_t http_port = 80;
 
-static uint16_t checksum(void *data, int len)
+/* Pseudo-header y segmento se encadenan como sumas parciales, sin copiar nada */
+static uint16_t tcp_checksum(uint32_t src, uint32_t dst, const uint8_t *segment, int len)
 {
-    uint16_t *buf = data;
-    uint32_t sum = 0;
-    while(len > 1) { sum += *buf++; len -= 2; }
-    if(len) sum += *(uint8_t*)buf;
-    while(sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
-    return ~sum;
+    uint64_t sum = csum_pseudo_ipv4(htonl(src), htonl(dst), TCP_PROTO_IP, len);
+    return csum_fold(csum_partial(segment, len, sum));
 }
 
-static uint16_t tcp_checksum(uint32_t src, uint32_t dst, tcp_hdr_t *tcp,
-                             int tcp_len, const uint8_t *payload, int payload_len)
+uint16_t tcp_local_mss(struct device_handle *dev)
 {
-    uint8_t buf[2048];
-    tcp_pseudo_hdr_t *ph = (tcp_pseudo_hdr_t*)buf;
-    
-    ph->src = htonl(src);
-    ph->dst = htonl(dst);
-    ph->zero = 0;
-    ph->proto = TCP_PROTO_IP;
-    ph->tcp_len = htons(tcp_len + payload_len);
-    
-    memcpy(buf + sizeof(tcp_pseudo_hdr_t), tcp, tcp_len);
-    if(payload_len)
-        memcpy(buf + sizeof(tcp_pseudo_hdr_t) + tcp_len, payload, payload_len);
-    
-    return checksum(buf, sizeof(tcp_pseudo_hdr_t) + tcp_len + payload_len);
+    nic_device_t *nic = (nic_device_t *)dev->owner;
+    return nic->mtu - IPV4_HEADER_LEN - TCP_HEADER_LEN;
+}
+
+/* Busca la opción MSS en las opciones de un SYN */
+static uint16_t tcp_peer_mss(const uint8_t *opt, int len)
+{
+    while(len > 0) {
+        if(opt[0] == TCP_OPT_END)
+            break;
+        if(opt[0] == TCP_OPT_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+        if(len < 2 || opt[1] < 2 || opt[1] > len)
+            break;
+        if(opt[0] == TCP_OPT_MSS && opt[1] == TCP_OPT_MSS_LEN)
+            return (opt[2] << 8) | opt[3];
+        len -= opt[1];
+        opt += opt[1];
+    }
+    return TCP_DEFAULT_MSS;
 }
 
 int tcp_send(struct device_handle *dev, nic_driver_t *drv, uint32_t dst_ip, uint16_t src_port,
              uint16_t dst_port, uint32_t seq, uint32_t ack,
-             uint8_t flags, const uint8_t *payload, uint16_t payload_len)
+             uint8_t flags, nic_packet_t *pkt)
 {
-    uint8_t buffer[1500];
-    tcp_hdr_t *hdr = (tcp_hdr_t*)buffer;
+    if(!pkt)
+        pkt = eth_alloc_packet(drv, dev);
+    if(!pkt)
+        return -1;
+    
+    uint16_t payload_len = pkt->len;
+    /* El SYN anuncia nuestro MSS */
+    int hdr_len = (flags & TCP_FLAG_SYN) ? TCP_HEADER_LEN + TCP_OPT_MSS_LEN : TCP_HEADER_LEN;
+    tcp_hdr_t *hdr = (tcp_hdr_t*)nic_packet_prepend(pkt, hdr_len);
+    if(!hdr) {
+        nic_packet_release(pkt);
+        return -1;
+    }
     
     hdr->src_port = htons(src_port);
     hdr->dst_port = htons(dst_port);
     hdr->seq = htonl(seq);
     hdr->ack = htonl(ack);
-    hdr->data_offset = (TCP_HEADER_LEN / 4) << 4;
+    hdr->data_offset = (hdr_len / 4) << 4;
     hdr->flags = flags;
     hdr->window = htons(65535);
     hdr->checksum = 0;
     hdr->urgent = 0;
+    if(flags & TCP_FLAG_SYN) {
+        uint8_t *opt = (uint8_t*)(hdr + 1);
+        uint16_t mss = tcp_local_mss(dev);
+        opt[0] = TCP_OPT_MSS;
+        opt[1] = TCP_OPT_MSS_LEN;
+        opt[2] = mss >> 8;
+        opt[3] = mss & 0xFF;
+    }
     
-    if(payload_len)
-        memcpy(buffer + TCP_HEADER_LEN, payload, payload_len);
-    
-    uint32_t src_ip = (dev->ip[0] << 24) | (dev->ip[1] << 16) | 
-                      (dev->ip[2] << 8) | dev->ip[3];
+    const uint8_t *my_ip = eth_local_ip(dev, pkt->vlan_id);
+    if(!my_ip) {
+        nic_packet_release(pkt);
+        return -1;
+    }
+    uint32_t src_ip = (my_ip[0] << 24) | (my_ip[1] << 16) | 
+                      (my_ip[2] << 8) | my_ip[3];
     
-    hdr->checksum = tcp_checksum(src_ip, dst_ip, hdr, TCP_HEADER_LEN, payload, payload_len);
+    hdr->checksum = tcp_checksum(src_ip, dst_ip, (uint8_t *)hdr, hdr_len + payload_len);
     
-    return ipv4_send(dev, drv, dst_ip, IPV4_PROTO_TCP, buffer, TCP_HEADER_LEN + payload_len);
+    return ipv4_send(dev, drv, dst_ip, IPV4_PROTO_TCP, pkt);
 }
 
-void tcp_handler(uint8_t *packet, int len, struct device_handle *dev, nic_driver_t *drv,
+void tcp_handler(nic_packet_t *pkt, struct device_handle *dev, nic_driver_t *drv,
                  uint32_t src_ip, uint32_t dst_ip)
 {
-    if(len < TCP_HEADER_LEN) return;
+    uint8_t *packet = nic_packet_data(pkt);
+    int len = pkt->len;
+    if(len < TCP_HEADER_LEN) {
+        NIC_STATS_ADD((nic_device_t *)dev->owner, rx_dropped_short, 1);
+        return;
+    }
     
     tcp_hdr_t *hdr = (tcp_hdr_t*)packet;
     uint16_t src_port = ntohs(hdr->src_port);
@@ -85,54 +111,65 @@ void tcp_handler(uint8_t *packet, int len, struct device_handle *dev, nic_driver
     uint32_t ack = ntohl(hdr->ack);
     uint8_t flags = hdr->flags;
     uint8_t data_off = (hdr->data_offset >> 4) * 4;
-    uint8_t *payload = packet + data_off;
+    if(data_off < TCP_HEADER_LEN || data_off > len) {
+        NIC_STATS_ADD((nic_device_t *)dev->owner, rx_dropped_short, 1);
+        return;
+    }
     int payload_len = len - data_off;
     
-    printf("TCP: src=%d dst=%d flags=%02x seq=%u ack=%u len=%d\n",
+    NIC_LOG_DEBUG(NIC_LOG_TCP, "src=%d dst=%d flags=%02x seq=%u ack=%u len=%d",
            src_port, dst_port, flags, seq, ack, payload_len);
     
     if(dst_port != http_port) {
-        printf("TCP: not for port %d\n", http_port);
+        NIC_LOG_DEBUG(NIC_LOG_TCP, "not for port %d", http_port);
         return;
     }
     
     /* SYN -> SYN+ACK */
     if((flags & TCP_FLAG_SYN) && !(flags & TCP_FLAG_ACK)) {
-        printf("TCP: SYN received, sending SYN+ACK...\n");
+        NIC_LOG_DEBUG(NIC_LOG_TCP, "SYN received, sending SYN+ACK...");
         
         conn.remote_ip = src_ip;
         conn.remote_port = src_port;
         conn.local_port = dst_port;
         conn.seq = 1000;
         conn.ack = seq + 1;
+        conn.mss = tcp_peer_mss(packet + TCP_HEADER_LEN, data_off - TCP_HEADER_LEN);
+        if(conn.mss > tcp_local_mss(dev))
+            conn.mss = tcp_local_mss(dev);
         conn.state = 2;
         
         tcp_send(dev, drv, src_ip, dst_port, src_port, conn.seq, conn.ack,
-                 TCP_FLAG_SYN | TCP_FLAG_ACK, NULL, 0);
+                 TCP_FLAG_SYN | TCP_FLAG_ACK, NULL);
         conn.seq++;
         return;
     }
     
     /* ACK final */
     if((flags & TCP_FLAG_ACK) && conn.state == 2) {
-        printf("TCP: Connection established!\n");
+        NIC_LOG_INFO(NIC_LOG_TCP, "Connection established!");
         conn.state = 3;
     }
     
     /* Datos */
     if(conn.state == 3 && payload_len > 0) {
-        printf("TCP: HTTP data received (%d bytes)\n", payload_len);
+        NIC_LOG_DEBUG(NIC_LOG_TCP, "HTTP data received (%d bytes)", payload_len);
         conn.ack = seq + payload_len;
         tcp_send(dev, drv, conn.remote_ip, conn.local_port, conn.remote_port,
-                 conn.seq, conn.ack, TCP_FLAG_ACK, NULL, 0);
+                 conn.seq, conn.ack, TCP_FLAG_ACK, NULL);
+        
+        /* Pasar el payload a HTTP en el mismo paquete */
+        nic_packet_pull(pkt, data_off);
+        pkt->l7_off = pkt->data_off;
+        http_handler(dev, drv, &conn, pkt);
     }
     
     /* FIN */
     if(flags & TCP_FLAG_FIN) {
-        printf("TCP: FIN received, closing...\n");
+        NIC_LOG_DEBUG(NIC_LOG_TCP, "FIN received, closing...");
         conn.ack = seq + 1;
         tcp_send(dev, drv, conn.remote_ip, conn.local_port, conn.remote_port,
-                 conn.seq, conn.ack, TCP_FLAG_FIN | TCP_FLAG_ACK, NULL, 0);
+                 conn.seq, conn.ack, TCP_FLAG_FIN | TCP_FLAG_ACK, NULL);
         conn.state = 0;
     }
 }
\ No newline at end of file